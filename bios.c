@@ -46,6 +46,7 @@ typedef struct core
 	sig_atomic_t intpending[maximum_interrupt_no];
 
 	sig_atomic_t int_disabled;
+	sig_atomic_t sig_blocked;	/* SIGUSR1 is blocked, since a handler was entered */
 	sig_atomic_t halted;
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
@@ -191,6 +192,7 @@ static void* bootfunc_wrapper(void* _core)
 
 	/* Mark interrupts as enabled */
 	core->int_disabled = 0;
+	core->sig_blocked = 0;
 
 	/* establish the thread-local id */
 	CHECKRC(pthread_setspecific(Core_key, core));
@@ -257,8 +259,8 @@ static void dispatch_interrupts(Core* core)
 	for(int intno = 0; intno < maximum_interrupt_no; intno++) {
 		if(core->int_disabled) break; /* will continue at
 										 cpu_interrupt_enable()*/
-		if(core->intpending[intno]) {
-			core->intpending[intno] = 0;
+		/* The handler may interrupt us here, so take the pending flag atomically */
+		if(__atomic_exchange_n(& core->intpending[intno], 0, __ATOMIC_SEQ_CST)) {
 			core->irq_delivered[intno]++;
 			interrupt_handler* handler =  core->intvec[intno];
 			if(handler != NULL) { 
@@ -276,9 +278,18 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
 	Core* core = & CORE[si->si_value.sival_int];
 
+	/* SIGUSR1 is blocked until we return, or until interrupts are re-enabled
+	   (by another thread, if an interrupt handler switches context) */
+	core->sig_blocked = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
 	core->irq_count++;
-	if(core->int_disabled) return;
-	dispatch_interrupts(core);
+	if(! core->int_disabled) 
+		dispatch_interrupts(core);
+
+	/* On return, the signal mask is restored, unblocking SIGUSR1 */
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	core->sig_blocked = 0;
 }
 
 
@@ -745,6 +756,7 @@ void cpu_core_halt()
 		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
+	core->sig_blocked = 0;
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 	dispatch_interrupts(core);
 }
@@ -799,6 +811,43 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 }
 
 
+#if defined(__x86_64__)
+
+/*
+	Interrupts are disabled in software: while int_disabled is set, the 
+	SIGUSR1 handler only leaves the interrupt pending, and it is dispatched 
+	when interrupts are enabled. Therefore, we do not need to change the 
+	signal mask (a system call) each time, except to unblock SIGUSR1 after
+	a handler has switched to another context.
+
+	This needs a context switch which does not change the signal mask, see
+	cpu_context_switch(). With swapcontext(), each context has its own mask, 
+	and we block SIGUSR1 while interrupts are disabled.
+ */
+void cpu_disable_interrupts()
+{
+	Core* core = curr_core();
+	core->int_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void cpu_enable_interrupts()
+{
+	Core* core = curr_core();
+	if(core->int_disabled) {        
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		core->int_disabled = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		if(core->sig_blocked) {
+			core->sig_blocked = 0;
+			CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+		}
+		dispatch_interrupts(core);
+	}
+}
+
+#else
+
 void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
@@ -818,6 +867,89 @@ void cpu_enable_interrupts()
 	}
 }
 
+#endif
+
+
+#if defined(__x86_64__)
+
+/*
+	The x86-64 context switch.
+
+	cpu_context_switch(&old->sp, new->sp) pushes the callee-saved registers 
+	and the floating point control words on the current stack, saves the 
+	stack pointer, loads the new one and pops the same frame from the new 
+	stack. All other registers are saved by the caller, as in any call.
+
+	Unlike swapcontext(), this makes no system call: the signal mask is
+	not part of a context. The kernel switches contexts only with interrupts
+	disabled, which does not touch the signal mask either (see 
+	cpu_disable_interrupts).
+ */
+void cpu_context_switch(void** oldsp, void* newsp);
+
+__asm__(
+	".text\n"
+	".globl cpu_context_switch\n"
+	".type cpu_context_switch, @function\n"
+	"cpu_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_context_switch, .-cpu_context_switch\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*) top;
+
+	/* 
+		Build the frame that cpu_context_switch pops. The 'ret' enters ctx_func
+		as if it was called (with a null return address), so the stack is 
+		aligned as the ABI expects.
+	 */
+	*(--frame) = 0;                     /* return address of ctx_func */
+	*(--frame) = (uintptr_t) ctx_func;  /* return address of cpu_context_switch */
+	for(int i=0; i<6; i++) 
+		*(--frame) = 0;                 /* rbp, rbx, r12-r15 */
+
+	/* The floating point control words of this context */
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ __volatile__("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ __volatile__("fnstcw %0" : "=m"(fpucw));
+	*(--frame) = (uint64_t)mxcsr | ((uint64_t)fpucw << 32);
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_context_switch(& oldctx->sp, newctx->sp);
+}
+
+#else
 
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
@@ -840,6 +972,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
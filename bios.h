@@ -264,11 +264,28 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+#if defined(__x86_64__)
+
+/**
+	@brief A type for saving CPU context into.
+
+	On x86-64, a context switch saves only the callee-saved registers 
+	(and the floating point control words), on the stack of the context. 
+	The context is just the saved stack pointer. The signal mask is not 
+	part of the context, since context switches always happen with 
+	interrupts disabled.
+*/
+typedef struct { void* sp; } cpu_context_t;
+
+#else
+
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -53,6 +53,12 @@ void Mutex_Lock(Mutex* lock)
 }
 
 
+int Mutex_TryLock(Mutex* lock)
+{
+  return ! __atomic_test_and_set(lock,__ATOMIC_ACQUIRE);
+}
+
+
 void Mutex_Unlock(Mutex* lock)
 {
   __atomic_clear(lock, __ATOMIC_RELEASE);
@@ -288,6 +294,12 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	return ret;
 }
 
+int kernel_mxwait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause,
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
@@ -32,6 +32,18 @@
 
 
 
+/**
+	@brief Try to lock a mutex without waiting.
+
+	This is used by kernel code that must acquire locks out of the
+	normal lock order; on failure, the caller backs off instead of spinning.
+
+	@param lock the mutex to lock
+	@returns 1 if the mutex was locked, 0 if it was already held
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
 /*
  * Kernel preemption control.
  * These are wrappers for the kernel monitor.
@@ -59,6 +71,24 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable using a kernel mutex.
+
+	This is used by kernel code that runs without the kernel lock,
+	such as the data path of streams (@c Read and @c Write), where the
+	state is protected by the mutex of the stream object.
+
+	@param mx the mutex protecting the condition, locked by the caller
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_mxwait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause,
+	const char* wchan, TimerDuration timeout);
+
+#define kernel_mxwait(mx, cv, cause) \
+	kernel_mxwait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_mxtimedwait(mx, cv, cause, timeout) \
+	kernel_mxwait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
@@ -70,6 +70,9 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  char peek;          /* a character taken from the device by serial_poll */
+  int has_peek;
+  rlnode pollers;     /* the Poll calls waiting for input */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -91,6 +94,10 @@ void serial_rx_handler()
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
     Cond_Broadcast(&dcb->rx_ready);
+
+    Mutex_Lock(&dcb->spinlock);
+    poll_wakeup(&dcb->pollers);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -104,8 +111,18 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
   preempt_off;            /* Stop preemption */
 
+  /* Read runs without the kernel lock, concurrent readers of this 
+     terminal are serialized here */
+  Mutex_Lock(&dcb->spinlock);
+
   uint count =  0;
 
+  /* First, the character that serial_poll may have taken */
+  if(size>0 && dcb->has_peek) {
+    buf[count++] = dcb->peek;
+    dcb->has_peek = 0;
+  }
+
   while(count<size) {
     int valid = bios_read_serial(dcb->devno, &buf[count]);
     
@@ -113,12 +130,14 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_mxwait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
+
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -162,6 +181,34 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 }
 
 
+/*
+  Poll the device. The bios cannot tell us if input is available, 
+  so we take a character from the device and keep it for serial_read.
+  Writes are polled by serial_write, so they are always ready.
+ */
+int serial_poll(void* dev, int events, struct poll_waiter* w)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  int r = POLL_WRITE;
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  if(! dcb->has_peek)
+    dcb->has_peek = bios_read_serial(dcb->devno, &dcb->peek);
+
+  if(dcb->has_peek) 
+    r |= POLL_READ;
+  else if(w && (events & POLL_READ))
+    poll_register(w, &dcb->pollers, &dcb->spinlock);
+
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return r;
+}
+
+
 int serial_close(void* dev) 
 {
   return 0;
@@ -180,7 +227,8 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll
 };
 
 
@@ -211,6 +259,8 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].has_peek = 0;
+    rlnode_init(&serial_dcb[i].pollers, NULL);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
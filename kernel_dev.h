@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -81,6 +82,22 @@ typedef struct file_operations {
   */
     int (*Write)(void* this, const char* buf, unsigned int size);
 
+  /** @brief Vectored read operation.
+
+    Like @c Read, but into the @c iovcnt buffers of @c iov, in order.
+    This method is optional (it may be NULL); if missing, @c ReadV 
+    reads into a kernel buffer and scatters the data.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Vectored write operation.
+
+    Like @c Write, but from the @c iovcnt buffers of @c iov, in order.
+    This method is optional (it may be NULL); if missing, @c WriteV
+    calls @c Write for each buffer.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
     /** @brief Close operation.
 
       Close the stream object, deallocating any resources held by it.
@@ -92,6 +109,41 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Control operation.
+
+      Get or set a property of the stream object, as requested by
+      the @c StreamControl system call. This method is optional (it
+      may be NULL). It returns a non-negative value on success
+      and -1 if the command is not supported or fails.
+
+      This method is called with the kernel lock held.
+     */
+    int (*Control)(void* this, stream_control cmd, int arg);
+
+    /** @brief Return the pipe behind the stream.
+
+      Return the pipe that the stream reads from (if @c write is 0)
+      or writes to (if @c write is 1), or NULL. This is used by @c Splice
+      to move data directly between pipes. This method is optional (it 
+      may be NULL).
+
+      Like @c Read and @c Write, this method is called without the kernel lock.
+     */
+    PIPCB* (*GetPipe)(void* this, int write);
+
+    /** @brief Poll operation.
+
+      Return the events (@c POLL_READ, @c POLL_WRITE, @c POLL_HANGUP) which
+      are ready for the stream. If @c w is not NULL, also register @c w 
+      (by @c poll_register) with every list of pollers that will be woken
+      up when these events change, atomically with the check.
+      This method is optional (it may be NULL), in which case the
+      stream is always ready.
+
+      Like @c Read and @c Write, this method is called without the kernel lock.
+     */
+    int (*Poll)(void* this, int events, struct poll_waiter* w);
 } file_ops;
 
 
@@ -4,65 +4,290 @@
 /** Include needed files to make things work*/
 #include "kernel_streams.h"	//This contains fcb
 #include <kernel_cc.h>	//This is for kernel calls
+#include "kernel_slab.h"	//Pipe control blocks come from a slab cache
 
 
 
 
-/******************************READER OPS************************/
-/**Writer to specific size buffer, to the stream this. In that case we
-	are refering to pipes*/
-int pipe_read(void* this, char *buf, unsigned int size){
+_Static_assert((BUFFER_SIZE & (BUFFER_SIZE-1))==0, "BUFFER_SIZE must be a power of 2");
+_Static_assert((PIPE_PAGE_SIZE & (PIPE_PAGE_SIZE-1))==0, "PIPE_PAGE_SIZE must be a power of 2");
+_Static_assert((PIPE_MAX_SIZE & (PIPE_MAX_SIZE-1))==0, "PIPE_MAX_SIZE must be a power of 2");
+_Static_assert(PIPE_PAGE_SIZE <= BUFFER_SIZE && BUFFER_SIZE <= PIPE_MAX_SIZE, "Bad pipe sizes");
 
-	PIPCB* pipcb = (PIPCB *)this;
+/**Number of bytes in the buffer*/
+static inline unsigned int pipe_count(PIPCB* pipcb){
+	return pipcb->writerPos - pipcb->readerPos;
+}
 
-	/*In case our reader is closed return -1*/
-	if(pipcb->readerClosedFlag){
-		return -1;
+/**Move n bytes out of the buffer, in at most two spans (before and after the wrap)*/
+static void pipe_copy_out(PIPCB* pipcb, char* buf, unsigned int n){
+	if(n == 0) return;
+
+	unsigned int pos = pipcb->readerPos & (pipcb->bufsize-1);
+	unsigned int span = pipcb->bufsize - pos;
+	if(span > n) span = n;
+
+	memcpy(buf, pipcb->buffer + pos, span);
+	memcpy(buf + span, pipcb->buffer, n - span);
+	pipcb->readerPos += n;
+}
+
+/**Move n bytes into the buffer, in at most two spans (before and after the wrap)*/
+static void pipe_copy_in(PIPCB* pipcb, const char* buf, unsigned int n){
+	if(n == 0) return;
+
+	unsigned int pos = pipcb->writerPos & (pipcb->bufsize-1);
+	unsigned int span = pipcb->bufsize - pos;
+	if(span > n) span = n;
+
+	memcpy(pipcb->buffer + pos, buf, span);
+	memcpy(pipcb->buffer, buf + span, n - span);
+	pipcb->writerPos += n;
+	if(pipe_count(pipcb) > pipcb->peak) pipcb->peak = pipe_count(pipcb);
+}
+
+/**Reallocate the buffer to size bytes (0 to release it), keeping the data*/
+static void pipe_resize(PIPCB* pipcb, unsigned int size){
+	unsigned int count = pipe_count(pipcb);
+	assert(count <= size);
+
+	char* newbuf = (size > 0) ? (char*) xmalloc(size) : NULL;
+	pipe_copy_out(pipcb, newbuf, count);
+	free(pipcb->buffer);
+
+	pipcb->buffer = newbuf;
+	pipcb->bufsize = size;
+	pipcb->readerPos = 0;
+	pipcb->writerPos = count;
+}
+
+/**Move n bytes from one buffer to another, span by span*/
+static void pipe_transfer(PIPCB* from, PIPCB* to, unsigned int n){
+	while(n > 0){
+		unsigned int rpos = from->readerPos & (from->bufsize-1);
+		unsigned int wpos = to->writerPos & (to->bufsize-1);
+		unsigned int span = n;
+		if(span > from->bufsize - rpos) span = from->bufsize - rpos;
+		if(span > to->bufsize - wpos) span = to->bufsize - wpos;
+
+		memcpy(to->buffer + wpos, from->buffer + rpos, span);
+		from->readerPos += span;
+		to->writerPos += span;
+		n -= span;
 	}
+	if(pipe_count(to) > to->peak) to->peak = pipe_count(to);
+}
+
+/**
+	The buffer grows while the writers fill it, and it shrinks with some 
+	hysteresis, so that a pipe which keeps being filled does not free and 
+	reallocate its buffer on every round:
+	- When the buffer is drained, it shrinks to one page, but only if it was 
+	  at most half full since the previous drain.
+	- When a reader waits for data on an empty pipe, the pipe is idle, and 
+	  a buffer of one page is freed. A larger buffer is kept, since it was 
+	  needed by the last transfers.
+*/
+static void pipe_drained(PIPCB* pipcb){
+	if(pipcb->bufsize > PIPE_PAGE_SIZE && pipcb->peak <= pipcb->bufsize/2)
+		pipe_resize(pipcb, PIPE_PAGE_SIZE);
+	pipcb->peak = 0;
+}
+
+static void pipe_idle(PIPCB* pipcb){
+	if(pipcb->bufsize == PIPE_PAGE_SIZE && pipe_count(pipcb) == 0)
+		pipe_resize(pipcb, 0);
+}
+
+static slab_cache pipcb_cache = SLAB_CACHE(PIPCB);
 
-	if(pipcb->elementcounter == 0 && pipcb->writerClosedFlag){
+/**Release the pipe control block of a Pipe()*/
+static void pipe_free(PIPCB* pipcb){
+	slab_free(&pipcb_cache, pipcb);
+}
+
+/******************************MESSAGES************************/
+/**
+	A pipe in message mode keeps a queue of messages instead of a ring buffer.
+	Each write makes one message, and each read takes one message. The writer 
+	copies its data into a new message and the reader copies it out; neither 
+	holds the lock while copying, the lock only guards the handoff of the 
+	message between them. readerPos and writerPos count the bytes of the 
+	messages taken and queued, so pipe_count() is the number of bytes queued
+	and capacity limits it as for a byte pipe.
+*/
+typedef struct pipe_message {
+	rlnode node;         /**The node in the queue of messages*/
+	unsigned int len;    /**The size of data*/
+	char data[];
+} pipe_message;
+
+/**Send one message gathered from the buffers of iov. The lock is held on entry and released*/
+static int pipe_send_message(PIPCB* pipcb, const iovec_t* iov, unsigned int iovcnt){
+	Mutex_Unlock(pipcb->lock);
+
+	size_t len = 0;
+	for(unsigned int i=0; i<iovcnt; i++)
+		len += iov[i].len;
+
+	/*An empty message is not sent, since reading it would look like end of data*/
+	if(len == 0)
 		return 0;
-	}
+	if(len > PIPE_MAX_SIZE)
+		return -1;
 
-	
-	uint bufParser;
+	pipe_message* msg = (pipe_message*) xmalloc(sizeof(pipe_message) + len);
+	rlnode_init(&msg->node, msg);
+	msg->len = len;
+	size_t pos = 0;
+	for(unsigned int i=0; i<iovcnt; i++) {
+		memcpy(msg->data + pos, iov[i].base, iov[i].len);
+		pos += iov[i].len;
+	}
 
-	for(bufParser = 0; bufParser < size ; bufParser ++){
+	Mutex_Lock(pipcb->lock);
+
+	/*Wait until the message fits; a message larger than the capacity never does*/
+	int rc = len;
+	while(rc > 0){
+		if(pipcb->readerClosedFlag || pipcb->writerClosedFlag || len > pipcb->capacity)
+			rc = -1;
+		else if(pipe_count(pipcb) + len <= pipcb->capacity)
+			break;
+		else {
+			/*Pollers must wait for this much room (see pipe_writer_poll)*/
+			pipcb->blocked = len;
+			if(pipcb->writerFCB->nonblock)
+				rc = WOULDBLOCK;
+			else
+				kernel_mxwait(pipcb->lock, &pipcb->fullCase, SCHED_PIPE);
+		}
+	}
 
-		//case full broadcast etc
-		while(pipcb->elementcounter == 0 && !pipcb->readerClosedFlag&& !pipcb->writerClosedFlag){
-		
-			kernel_broadcast(&pipcb->fullCase);
-  			kernel_wait(&pipcb->emptyCase,SCHED_PIPE);
+	if(rc > 0){
+		pipcb->blocked = 0;
+		/*Wake up readers only when the queue stops being empty*/
+		if(pipe_count(pipcb) == 0){
+			kernel_broadcast(&pipcb->emptyCase);
+			poll_wakeup(&pipcb->pollers);
 		}
+		rlist_push_back(&pipcb->messages, &msg->node);
+		pipcb->writerPos += len;
+	}
 
+	Mutex_Unlock(pipcb->lock);
 
-		if(pipcb->elementcounter == 0 && pipcb->writerClosedFlag){
-			return bufParser;
-		}
+	if(rc <= 0)
+		free(msg);
+	return rc;
+}
 
-		/*When awake check if writer or reader is closed*/
-		if(pipcb->readerClosedFlag){
-			return bufParser;
+/**Receive one message into the buffers of iov, dropping what does not fit. 
+	The queue is not empty, the lock is held on entry and released*/
+static int pipe_recv_message(PIPCB* pipcb, const iovec_t* iov, unsigned int iovcnt){
+	pipe_message* msg = rlist_pop_front(&pipcb->messages)->obj;
+	pipcb->readerPos += msg->len;
+
+	/*Writers may be waiting for room, and they need a message's worth of it*/
+	kernel_broadcast(&pipcb->fullCase);
+	poll_wakeup(&pipcb->pollers);
+
+	Mutex_Unlock(pipcb->lock);
+
+	unsigned int nread = 0;
+	for(unsigned int i=0; i<iovcnt && nread<msg->len; i++){
+		unsigned int n = msg->len - nread;
+		if(n > iov[i].len) n = iov[i].len;
+		memcpy(iov[i].base, msg->data + nread, n);
+		nread += n;
+	}
+
+	free(msg);
+	return nread;
+}
+
+
+/**Release the pipe, once both ends are closed*/
+static void pipe_release(PIPCB* pipcb){
+	while(! is_rlist_empty(&pipcb->messages))
+		free(rlist_pop_front(&pipcb->messages)->obj);
+	free(pipcb->buffer);
+	pipcb->buffer = NULL;
+	pipcb->bufsize = 0;
+	pipcb->readerPos = pipcb->writerPos = 0;
+	if(pipcb->release)
+		pipcb->release(pipcb);
+}
+
+
+/******************************READER OPS************************/
+/**Read into the buffers of iov, in order. In that case we
+	are refering to pipes. We block only while the buffer is empty,
+	and return whatever is available (at least 1 byte), or 0 at end of data*/
+int pipe_readv(void* this, const iovec_t* iov, unsigned int iovcnt){
+
+	PIPCB* pipcb = (PIPCB *)this;
+
+	Mutex_Lock(pipcb->lock);
+
+	/*In case our reader is closed return -1*/
+	if(pipcb->readerClosedFlag){
+		Mutex_Unlock(pipcb->lock);
+		return -1;
+	}
+
+	/*Writers wake us only when the buffer stops being empty*/
+	while(pipe_count(pipcb) == 0 && !pipcb->readerClosedFlag && !pipcb->writerClosedFlag){
+		pipe_idle(pipcb);
+		/*A non-blocking reader does not wait*/
+		if(pipcb->readerFCB->nonblock){
+			Mutex_Unlock(pipcb->lock);
+			return WOULDBLOCK;
 		}
+		kernel_mxwait(pipcb->lock, &pipcb->emptyCase,SCHED_PIPE);
+	}
 
-		/*Only read when there are elements to read. Go back to start if list ends*/
-		if(pipcb->elementcounter >0){
-			pipcb->readerPos++;
-			if(pipcb->readerPos >= BUFFER_SIZE){
-				pipcb->readerPos = 0;
+	/*When awake check if reader is closed*/
+	if(pipcb->readerClosedFlag){
+		Mutex_Unlock(pipcb->lock);
+		return 0;
+	}
 
-			}
-			buf[bufParser] = pipcb->buffer[pipcb->readerPos];
-			pipcb->elementcounter--;
+	/*Without messages, the writer has closed*/
+	if(pipcb->message){
+		if(is_rlist_empty(&pipcb->messages)){
+			Mutex_Unlock(pipcb->lock);
+			return 0;
 		}
-		
+		return pipe_recv_message(pipcb, iov, iovcnt);
+	}
 
+	unsigned int count = pipe_count(pipcb);
+	unsigned int nread = 0;
+	for(unsigned int i=0; i<iovcnt && nread<count; i++){
+		unsigned int n = count - nread;
+		if(n > iov[i].len) n = iov[i].len;
+		pipe_copy_out(pipcb, iov[i].base, n);
+		nread += n;
 	}
 
-	kernel_broadcast(&pipcb->fullCase);
-	return bufParser;
-	
+	/*Wake up writers only when the buffer stops being full*/
+	if(count == pipcb->bufsize && nread > 0){
+		kernel_broadcast(&pipcb->fullCase);
+		poll_wakeup(&pipcb->pollers);
+	}
+
+	/*Give back the memory of an oversized buffer, once drained*/
+	if(pipe_count(pipcb) == 0)
+		pipe_drained(pipcb);
+
+	Mutex_Unlock(pipcb->lock);
+	return nread;
+}
+
+int pipe_read(void* this, char *buf, unsigned int size){
+	iovec_t iov = { .base = buf, .len = size };
+	return pipe_readv(this, &iov, 1);
 }
 
 
@@ -77,17 +302,25 @@ int pipe_reader_close(void* this){
 	
 	PIPCB* pipcb = (PIPCB *)this;
 
+	Mutex_Lock(pipcb->lock);
+
 	/*In case somehow, it tries to reclose*/
 	if (pipcb->readerClosedFlag == 1){
+		Mutex_Unlock(pipcb->lock);
 		return 0;
 	}
 
 	pipcb->readerClosedFlag = 1;
 	kernel_broadcast(&pipcb->emptyCase);
+	/*Wake up writers too, they must fail now*/
+	kernel_broadcast(&pipcb->fullCase);
+	poll_wakeup(&pipcb->pollers);
+	int both_closed = pipcb->writerClosedFlag;
+	Mutex_Unlock(pipcb->lock);
 
 	/**If both streams are closed then free both*/
-	if(pipcb->writerClosedFlag == 1){
-		free(pipcb);
+	if(both_closed){
+		pipe_release(pipcb);
 	}
 
 	/*if everything goes as planned return success*/
@@ -98,53 +331,80 @@ int pipe_reader_close(void* this){
 /******************************WRITER OPS*************************/
 
 
-int pipe_write(void* this, const char* buf, unsigned int size){
+/**Write all the buffers of iov, in order, blocking while the pipe is full*/
+int pipe_writev(void* this, const iovec_t* iov, unsigned int iovcnt){
 
 	PIPCB* pipcb = (PIPCB *)this;
 
+	Mutex_Lock(pipcb->lock);
 
 	/* In case writer is closed return -1. Also if reader is close d
 	you must not write as nobody will be there to read*/
 	if(pipcb->writerClosedFlag || pipcb->readerClosedFlag){
+		Mutex_Unlock(pipcb->lock);
 		return -1;
 	}
 
-	uint bufParser;
-
-	for(bufParser = 0; bufParser < size ; bufParser ++){
-
-		//case full broadcast etc
-		while(pipcb->elementcounter == BUFFER_SIZE && pipcb->readerClosedFlag==0){
-			kernel_broadcast(& pipcb->emptyCase);
-  			kernel_wait(& pipcb->fullCase,SCHED_PIPE);
+	if(pipcb->message)
+		return pipe_send_message(pipcb, iov, iovcnt);
+
+	unsigned int written = 0;
+	unsigned int i = 0;      /*the current buffer of iov*/
+	unsigned int pos = 0;    /*the position in the current buffer*/
+
+	while(1){
+
+		/*Skip the finished (or empty) buffers*/
+		while(i < iovcnt && pos == iov[i].len) { i++; pos = 0; }
+		if(i == iovcnt)
+			break;
+
+		/*Grow the buffer up to the capacity, else wait. 
+		  Readers wake us only when the buffer stops being full*/
+		while(pipe_count(pipcb) == pipcb->bufsize && !pipcb->readerClosedFlag && !pipcb->writerClosedFlag){
+			if(pipcb->bufsize < pipcb->capacity)
+				pipe_resize(pipcb, (pipcb->bufsize > 0) ? 2*pipcb->bufsize : PIPE_PAGE_SIZE);
+			else if(pipcb->writerFCB->nonblock){
+				/*A non-blocking writer returns what fits*/
+				Mutex_Unlock(pipcb->lock);
+				return (written > 0) ? (int) written : WOULDBLOCK;
+			}
+			else
+  				kernel_mxwait(pipcb->lock, & pipcb->fullCase,SCHED_PIPE);
 		}
 
-		
 		/*When reader closed return -1*/
 		if(pipcb->readerClosedFlag){
+			Mutex_Unlock(pipcb->lock);
 			return -1;
 		}
 
-		/*When writer closed return buf size*/
+		/*When writer closed return what was written*/
 		if(pipcb->writerClosedFlag){
-			return bufParser;
+			break;
 		}
 
-		
-		/*If we overpass buffer size go back to start*/
-		pipcb->writerPos++;
-		if(pipcb->writerPos >= BUFFER_SIZE){
-			pipcb->writerPos = 0;
-
+		unsigned int count = pipe_count(pipcb);
+		unsigned int n = pipcb->bufsize - count;
+		if(n > iov[i].len - pos) n = iov[i].len - pos;
+		pipe_copy_in(pipcb, (const char*)iov[i].base + pos, n);
+		pos += n;
+		written += n;
+
+		/*Wake up readers only when the buffer stops being empty*/
+		if(count == 0){
+			kernel_broadcast(&pipcb->emptyCase);
+			poll_wakeup(&pipcb->pollers);
 		}
-		pipcb->buffer[pipcb->writerPos] = buf[bufParser];
-		pipcb->elementcounter++;
-
 	}
 
-	/**broadcast emptyCase(reader) that wait to read */
-	kernel_broadcast(&pipcb->emptyCase);
-	return bufParser;
+	Mutex_Unlock(pipcb->lock);
+	return written;
+}
+
+int pipe_write(void* this, const char* buf, unsigned int size){
+	iovec_t iov = { .base = (void*) buf, .len = size };
+	return pipe_writev(this, &iov, 1);
 }
 
 
@@ -160,24 +420,247 @@ int pipe_writer_close(void* this){
 
 	PIPCB* pipcb = (PIPCB *)this;
 
+	Mutex_Lock(pipcb->lock);
+
 	//TODO ask
 	/*In case somehow, it tries to reclose*/
 	if (pipcb->writerClosedFlag == 1){
+		Mutex_Unlock(pipcb->lock);
 		return 0;
 	}
 
 	pipcb->writerClosedFlag = 1;
 	kernel_broadcast(&pipcb->fullCase);
+	/*Wake up readers too, they see end of data now*/
+	kernel_broadcast(&pipcb->emptyCase);
+	poll_wakeup(&pipcb->pollers);
+	int both_closed = pipcb->readerClosedFlag;
+	Mutex_Unlock(pipcb->lock);
 
 	/**If both streams are closed then free both*/
-	if(pipcb->readerClosedFlag == 1){
-		free(pipcb);
+	if(both_closed){
+		pipe_release(pipcb);
 	}
 
 	/*if everything goes as planned return success*/
 	return 0;
 }
 
+/***************************SPLICE*************************/
+
+/**Lock two pipes, in address order to avoid deadlock. The two directions
+	of a socket connection share one lock, which is locked once*/
+static void pipe_lock2(PIPCB* a, PIPCB* b){
+	if(a->lock > b->lock) { PIPCB* t = a; a = b; b = t; }
+	Mutex_Lock(a->lock);
+	if(b->lock != a->lock)
+		Mutex_Lock(b->lock);
+}
+
+static void pipe_unlock2(PIPCB* a, PIPCB* b){
+	Mutex_Unlock(a->lock);
+	if(b->lock != a->lock)
+		Mutex_Unlock(b->lock);
+}
+
+/**Move up to size bytes from pipe 'from' to pipe 'to', directly between the two buffers.
+	Like a read, we block only while 'from' is empty, and stop when it drains. 
+	Like a write, we block while 'to' is full. Return the number of bytes moved,
+	0 at end of data, or -1 on error. If either end is non-blocking, we return
+	what was moved (or WOULDBLOCK) instead of blocking*/
+int pipe_splice(PIPCB* from, PIPCB* to, unsigned int size){
+
+	/*Messages cannot be spliced, they would lose their boundaries*/
+	if(from == to || from->message || to->message)
+		return -1;
+
+	unsigned int moved = 0;
+	int error = 0;
+	int nonblock = from->readerFCB->nonblock || to->writerFCB->nonblock;
+
+	pipe_lock2(from, to);
+
+	while(moved < size){
+
+		/*As in pipe_read and pipe_write*/
+		if(from->readerClosedFlag || to->readerClosedFlag || to->writerClosedFlag){
+			error = -1;
+			break;
+		}
+
+		unsigned int avail = pipe_count(from);
+		if(avail == 0){
+			if(moved > 0 || from->writerClosedFlag)
+				break;
+			pipe_idle(from);
+			if(nonblock){
+				error = WOULDBLOCK;
+				break;
+			}
+
+			/*Wait for data, holding only the lock of 'from'*/
+			if(to->lock != from->lock)
+				Mutex_Unlock(to->lock);
+			kernel_mxwait(from->lock, &from->emptyCase, SCHED_PIPE);
+			Mutex_Unlock(from->lock);
+			pipe_lock2(from, to);
+			continue;
+		}
+
+		unsigned int count = pipe_count(to);
+		if(count == to->bufsize){
+			if(to->bufsize < to->capacity){
+				pipe_resize(to, (to->bufsize > 0) ? 2*to->bufsize : PIPE_PAGE_SIZE);
+				continue;
+			}
+
+			if(nonblock){
+				error = WOULDBLOCK;
+				break;
+			}
+
+			/*Wait for space, holding only the lock of 'to'*/
+			if(from->lock != to->lock)
+				Mutex_Unlock(from->lock);
+			kernel_mxwait(to->lock, &to->fullCase, SCHED_PIPE);
+			Mutex_Unlock(to->lock);
+			pipe_lock2(from, to);
+			continue;
+		}
+
+		unsigned int n = to->bufsize - count;
+		if(n > avail) n = avail;
+		if(n > size - moved) n = size - moved;
+		pipe_transfer(from, to, n);
+		moved += n;
+
+		/*Wake up the other sides, only on transitions*/
+		if(avail == from->bufsize){
+			kernel_broadcast(&from->fullCase);
+			poll_wakeup(&from->pollers);
+		}
+		if(count == 0){
+			kernel_broadcast(&to->emptyCase);
+			poll_wakeup(&to->pollers);
+		}
+
+		if(pipe_count(from) == 0)
+			pipe_drained(from);
+	}
+
+	pipe_unlock2(from, to);
+
+	return (error && moved == 0) ? error : (int) moved;
+}
+
+/**The pipe behind each end, in the direction of the end*/
+static PIPCB* pipe_reader_get_pipe(void* this, int write){
+	return write ? NULL : (PIPCB *)this;
+}
+
+static PIPCB* pipe_writer_get_pipe(void* this, int write){
+	return write ? (PIPCB *)this : NULL;
+}
+
+
+/***************************POLL*************************/
+
+/**The reader is ready when there is data, or at end of data*/
+int pipe_reader_poll(void* this, int events, struct poll_waiter* w){
+
+	PIPCB* pipcb = (PIPCB *)this;
+
+	Mutex_Lock(pipcb->lock);
+
+	int r = 0;
+	if(pipe_count(pipcb) > 0 || pipcb->writerClosedFlag)
+		r |= POLL_READ;
+	if(pipcb->writerClosedFlag)
+		r |= POLL_HANGUP;
+
+	/*A reader that polls an empty pipe waits for data, as in pipe_readv*/
+	if(w && !(r & events)){
+		pipe_idle(pipcb);
+		poll_register(w, &pipcb->pollers, pipcb->lock);
+	}
+
+	Mutex_Unlock(pipcb->lock);
+	return r;
+}
+
+/**The writer is ready when there is room (or the buffer can grow), or when 
+	the reader is closed and a write fails at once*/
+int pipe_writer_poll(void* this, int events, struct poll_waiter* w){
+
+	PIPCB* pipcb = (PIPCB *)this;
+
+	Mutex_Lock(pipcb->lock);
+
+	/*In message mode, a message that did not fit must fit before the pipe 
+	  is writable again, else a non-blocking writer would spin on Poll and 
+	  a failing Write. If the capacity shrank below it, Write fails at once*/
+	unsigned int room = (pipcb->blocked > 0 && pipcb->blocked <= pipcb->capacity) 
+		? pipcb->blocked : 1;
+
+	int r = 0;
+	if(pipe_count(pipcb) + room <= pipcb->capacity || pipcb->readerClosedFlag)
+		r |= POLL_WRITE;
+	if(pipcb->readerClosedFlag)
+		r |= POLL_HANGUP;
+
+	if(w && !(r & events))
+		poll_register(w, &pipcb->pollers, pipcb->lock);
+
+	Mutex_Unlock(pipcb->lock);
+	return r;
+}
+
+
+/***************************CONTROL (BOTH ENDS)*************************/
+
+int pipe_control(void* this, stream_control cmd, int arg){
+
+	PIPCB* pipcb = (PIPCB *)this;
+	int ret = -1;
+
+	Mutex_Lock(pipcb->lock);
+
+	switch(cmd){
+		case CTL_GET_PIPE_SIZE:
+			ret = pipcb->capacity;
+			break;
+
+		case CTL_SET_PIPE_SIZE:
+			if(arg <= 0 || arg > PIPE_MAX_SIZE)
+				break;
+
+			/*Round up to a power of 2, at least a page*/
+			unsigned int capacity = PIPE_PAGE_SIZE;
+			while(capacity < (unsigned int) arg) capacity *= 2;
+
+			/*Do not lose data*/
+			if(pipe_count(pipcb) > capacity)
+				break;
+
+			if(pipcb->bufsize > capacity)
+				pipe_resize(pipcb, capacity);
+			pipcb->capacity = capacity;
+
+			/*Writers may be able to grow the buffer now*/
+			kernel_broadcast(&pipcb->fullCase);
+			poll_wakeup(&pipcb->pollers);
+			ret = capacity;
+			break;
+
+		default:
+			break;
+	}
+
+	Mutex_Unlock(pipcb->lock);
+	return ret;
+}
+
+
 /***************************FILE OPS USED(STATIC)****************************/
 /**
 	File ops are defined in kernel_dev.h. We initially had to 
@@ -189,32 +672,56 @@ static file_ops reader_ops = {
   .Open = NULL,	//TODO check if NULL or if need to assign value OR -1 ASSIGN
   .Read = pipe_read,
   .Write = N_pipe_write,
-  .Close = pipe_reader_close
+  .Close = pipe_reader_close,
+  .ReadV = pipe_readv,
+  .Control = pipe_control,
+  .GetPipe = pipe_reader_get_pipe,
+  .Poll = pipe_reader_poll
 };
 
 static file_ops writer_ops = {
   .Open = NULL,//TODO check if NULL or if need to assign value
   .Read = N_pipe_read,
   .Write = pipe_write,
-  .Close = pipe_writer_close
+  .Close = pipe_writer_close,
+  .WriteV = pipe_writev,
+  .Control = pipe_control,
+  .GetPipe = pipe_writer_get_pipe,
+  .Poll = pipe_writer_poll
 };
 
-PIPCB* pipe_Init(FCB** fcb)
+void pipe_init(PIPCB* pipcb, FCB* reader, FCB* writer, Mutex* lock, void (*release)(PIPCB*))
 {
-	/**Allocate memory for our pipe control block*/
-	PIPCB *pipcb = (PIPCB *)xmalloc(sizeof(PIPCB));
-
 	/** Initialiaze everything from pipe_control_block*/
+	pipcb->buffer = NULL;
+	pipcb->bufsize = 0;
+	pipcb->capacity = BUFFER_SIZE;
 	pipcb->readerPos = 0;
 	pipcb->writerPos = 0;
+	pipcb->peak = 0;
+	pipcb->blocked = 0;
 	pipcb->fullCase = COND_INIT;
 	pipcb->emptyCase = COND_INIT;
 	pipcb->readerClosedFlag = 0;
 	pipcb->writerClosedFlag = 0;
-	pipcb->elementcounter = 0;
+	pipcb->spinlock = MUTEX_INIT;
+	pipcb->lock = lock;
+	pipcb->release = release;
+	pipcb->message = 0;
+	rlnode_init(&pipcb->messages, NULL);
+	rlnode_init(&pipcb->pollers, NULL);
 	//---------------------------- Do we need to initialize the buffer?????? ------------------------------------------
-	pipcb->readerFCB = fcb[0];
-	pipcb->writerFCB = fcb[1];	/**INITIALIAZED THE VARIABLES BUT MAYBE THEY ARE NOT USED*/
+	pipcb->readerFCB = reader;
+	pipcb->writerFCB = writer;	/**INITIALIAZED THE VARIABLES BUT MAYBE THEY ARE NOT USED*/
+}
+
+PIPCB* pipe_Init(FCB** fcb)
+{
+	/**Allocate memory for our pipe control block*/
+	PIPCB *pipcb = (PIPCB *)slab_alloc(&pipcb_cache);
+
+	/**A pipe has a lock of its own*/
+	pipe_init(pipcb, fcb[0], fcb[1], &pipcb->spinlock, pipe_free);
 
 	return pipcb;
 }
@@ -3,6 +3,7 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_slab.h"
 
 
 /* 
@@ -15,18 +16,44 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table.
+  ------------------
+
+  The process table is a two-level table: PT holds pointers to chunks of 
+  PCB_CHUNK_SIZE PCBs, which are allocated and initialized on demand, the
+  first time a pid in them is needed. Chunks are allocated in pid order, 
+  so all pids below pcb_limit have a PCB. 
+
+  Boot only allocates the first chunk, and a chunk is kept until the next 
+  boot.
+ */
+#define PCB_CHUNK_BITS  8
+#define PCB_CHUNK_SIZE  (1<<PCB_CHUNK_BITS)
+#define PCB_CHUNKS      (MAX_PROC/PCB_CHUNK_SIZE)
+
+_Static_assert(MAX_PROC % PCB_CHUNK_SIZE == 0, "MAX_PROC must be a multiple of PCB_CHUNK_SIZE");
+
+static PCB* PT[PCB_CHUNKS];
+static Pid_t pcb_limit;
 unsigned int process_count;
 
+/* Return the PCB of a pid, or NULL if its chunk is not allocated */
+static inline PCB* pcb_slot(Pid_t pid)
+{
+  if(pid < 0 || pid >= pcb_limit) return NULL;
+  return & PT[pid >> PCB_CHUNK_BITS][pid & (PCB_CHUNK_SIZE-1)];
+}
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  PCB* pcb = pcb_slot(pid);
+  return (pcb==NULL || pcb->pstate==FREE) ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 //VDK EDIT
@@ -36,14 +63,15 @@ Pid_t get_ppid(PCB* pcb)
 }
 
 /* Initialize a PCB */
-static inline void initialize_PCB(PCB* pcb)
+static inline void initialize_PCB(PCB* pcb, Pid_t pid)
 {
+  pcb->pid = pid;
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  pcb->fidt = NULL;
+  pcb->fidt_spinlock = MUTEX_INIT;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -53,6 +81,9 @@ static inline void initialize_PCB(PCB* pcb)
 //  VDK Edit
   rlnode_init(& pcb->ptcb_list, NULL);
   pcb ->ptcb_counter = 0;
+  pcb->thread_table = NULL;
+  pcb->thread_table_size = 0;
+  pcb->thread_table_free = -1;
 
   pcb->thread_count = 0;
 
@@ -64,21 +95,41 @@ static inline void initialize_PCB(PCB* pcb)
 
 static PCB* pcb_freelist;
 
-void initialize_processes()
+/* 
+  Allocate the next chunk of the process table, and add its PCBs
+  to the free list. Returns 0 if the table is full.
+ */
+static int grow_process_table()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
+  if(pcb_limit >= MAX_PROC) return 0;
+
+  PCB* chunk = (PCB*) xmalloc(PCB_CHUNK_SIZE*sizeof(PCB));
+  PT[pcb_limit >> PCB_CHUNK_BITS] = chunk;
+
+  /* use the parent field to build a free list, in pid order */
+  for(int i=PCB_CHUNK_SIZE; i>0; ) {
+    --i;
+    initialize_PCB(&chunk[i], pcb_limit+i);
+    chunk[i].parent = pcb_freelist;
+    pcb_freelist = &chunk[i];
   }
 
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
+  pcb_limit += PCB_CHUNK_SIZE;
+  return 1;
+}
+
+void initialize_processes()
+{
+  /* release the chunks of a previous boot */
+  for(int c=0; c<PCB_CHUNKS; c++) {
+    free(PT[c]);
+    PT[c] = NULL;
   }
+  pcb_limit = 0;
+  pcb_freelist = NULL;
+
+  /* initialize the PCBs of the first chunk */
+  grow_process_table();
 
   process_count = 0;
 
@@ -95,6 +146,9 @@ PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  if(pcb_freelist == NULL)
+    grow_process_table();
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
@@ -166,12 +220,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    /* Inherit file streams from parent, sharing its file id table */
+    FIDT_inherit(newproc, curproc);
   }
 
 
@@ -194,7 +244,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
    */
   if(call != NULL) {
     newproc->ptcb_counter++;
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, THREAD_STACK_SIZE);
     wakeup(newproc->main_thread);
   }
 
@@ -314,12 +364,7 @@ void sys_Exit(int exitval)
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  FIDT_release(curproc);
 
   /* Reparent any children of the exiting process to the 
      initial task */
@@ -355,12 +400,8 @@ void sys_Exit(int exitval)
 
   //In case we find the last  ptcb clean up everything
   //The same as ThreadExit
-    if(CURPROC->ptcb_counter == 0){
-      while(! is_rlist_empty(& (CURPROC->ptcb_list))){
-        rlnode* tmp = rlist_pop_front(&(CURPROC->ptcb_list));
-        free(tmp->ptcb);
-      }
-    }
+    if(CURPROC->ptcb_counter == 0)
+      release_all_PTCBs(CURPROC);
 
     //VDK EDIT PHASE 2
     curproc->thread_count--;
@@ -371,39 +412,47 @@ void sys_Exit(int exitval)
 /***************************SYSTEM INFO**********************************/
 //VDK Edit
 
+// The info streams and their procinfo buffers come from slab caches
+static slab_cache pcinfocb_cache = SLAB_CACHE(PCINFOCB);
+static slab_cache procinfo_cache = SLAB_CACHE(procinfo);
+
 // Read scans PT table and returns data from active pcb's
 int pcinfocb_read(void* this, char* buf, unsigned int size){
   
   PCINFOCB* pcinfocb = (PCINFOCB*)this;
 
-  // Scan until we reach the end of the PT list
-  while(pcinfocb->cursor < MAX_PROC){
+  // Read runs without the kernel lock, but we need it to scan the PT
+  kernel_lock();
+
+  // Scan until we reach the end of the allocated part of the PT
+  while(pcinfocb->cursor < pcb_limit){
 
-    // PCB PT[MAX_PROC] is defined at the top of the file.
+    // The PT is defined at the top of the file.
     // We are always looking for ALIVE/ZOMBIE pcb's state so that we don't need to find 
     // pid_t check NOPROC.
+    PCB* pcb = pcb_slot(pcinfocb->cursor);
 
-    if(PT[pcinfocb->cursor].pstate == ALIVE || PT[pcinfocb->cursor].pstate == ZOMBIE){
+    if(pcb->pstate == ALIVE || pcb->pstate == ZOMBIE){
       //Allocate memory for all data(procinfo)
-      pcinfocb->data = (procinfo*)xmalloc(sizeof(procinfo));
+      pcinfocb->data = (procinfo*)slab_alloc(&procinfo_cache);
 
       //Get info for all elements assigned in data
-      pcinfocb->data->pid = get_pid(& PT[pcinfocb->cursor]);
+      pcinfocb->data->pid = get_pid(pcb);
      
-      pcinfocb->data->ppid = get_pid(PT[pcinfocb->cursor].parent);
+      pcinfocb->data->ppid = get_pid(pcb->parent);
 
-      pcinfocb->data->alive =((PT[pcinfocb->cursor].pstate == ALIVE) ? 1 : 0);
-      pcinfocb->data->thread_count = PT[pcinfocb->cursor].thread_count; /**Added thread_count attribute for phase 2*/
-      pcinfocb->data->main_task = PT[pcinfocb->cursor].main_task;
-      pcinfocb->data->argl = PT[pcinfocb->cursor].argl;
+      pcinfocb->data->alive =((pcb->pstate == ALIVE) ? 1 : 0);
+      pcinfocb->data->thread_count = pcb->thread_count; /**Added thread_count attribute for phase 2*/
+      pcinfocb->data->main_task = pcb->main_task;
+      pcinfocb->data->argl = pcb->argl;
 
       // For args as it is mentioned in tinyos.h we must first check length argl
       // and if is not higher than max_args_size then we assign it current length.
       // Otherwise, keep size = max_args_size
-      if(PT[pcinfocb->cursor].argl > PROCINFO_MAX_ARGS_SIZE){
-        memcpy(pcinfocb->data->args, PT[pcinfocb->cursor].args, PROCINFO_MAX_ARGS_SIZE);
+      if(pcb->argl > PROCINFO_MAX_ARGS_SIZE){
+        memcpy(pcinfocb->data->args, pcb->args, PROCINFO_MAX_ARGS_SIZE);
       }else{
-        memcpy(pcinfocb->data->args, PT[pcinfocb->cursor].args, PT[pcinfocb->cursor].argl);
+        memcpy(pcinfocb->data->args, pcb->args, pcb->argl);
       }
 
 
@@ -413,11 +462,12 @@ int pcinfocb_read(void* this, char* buf, unsigned int size){
       memcpy(buf, pcinfocb->data,size);
 
       //Free data as we do not need it afterwards
-      free(pcinfocb->data);
+      slab_free(&procinfo_cache, pcinfocb->data);
 
        //Go to next pcb
       pcinfocb->cursor++;
 
+      kernel_unlock();
       return size;
 
     }
@@ -426,13 +476,15 @@ int pcinfocb_read(void* this, char* buf, unsigned int size){
     pcinfocb->cursor++;
   }
 
+  kernel_unlock();
+
   //When PT has finished scanning return 0 to trigger finish
   return 0;
 }
 
 //We don't need to do much. Just release the object and return 0;
 int pcinfocb_close(void* this){
-  free(this);
+  slab_free(&pcinfocb_cache, this);
   return 0;
 }
 
@@ -460,7 +512,7 @@ Fid_t sys_OpenInfo()
   }
 
   /**Memory allocation for process info control block*/
-  PCINFOCB* pcinfocb = (PCINFOCB*)xmalloc(sizeof(PCINFOCB));
+  PCINFOCB* pcinfocb = (PCINFOCB*)slab_alloc(&pcinfocb_cache);
 
   //TODO CHECK MAYBE 1
   pcinfocb->cursor = 0;
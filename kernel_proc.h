@@ -30,12 +30,27 @@ typedef enum pid_state_e {
   ZOMBIE  /**< The PID is held by a zombie */
 } pid_state;
 
+/**
+  @brief A slot of the thread table of a process.
+
+  The thread table maps thread ids to PTCBs. A @c Tid_t holds the index
+  of a slot and the generation of the slot when the thread was created.
+  The generation changes every time a slot is freed, so that stale 
+  thread ids do not match the thread that reuses the slot.
+ */
+typedef struct thread_table_slot {
+  struct process_thread_control_block* ptcb;  /**< The PTCB, or NULL if free */
+  Tid_t gen;                /**< The generation of the slot */
+  int next_free;            /**< The next free slot, or -1 */
+} thread_slot;
+
 /**
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
  */
 typedef struct process_control_block {
+  Pid_t pid;              /**< The pid of this PCB */
   pid_state  pstate;      /**< The pid state for this PCB */
 
   PCB* parent;            /**< Parent's pcb. */
@@ -57,7 +72,13 @@ typedef struct process_control_block {
   rlnode ptcb_list;       /**<List of PTCBs*/
   uint ptcb_counter;      /**<PTCB List Counter */
 
-  FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  thread_slot* thread_table; /**< The thread table, indexed by @c Tid_t */
+  uint thread_table_size;    /**< The number of slots in @c thread_table */
+  int thread_table_free;     /**< The first free slot, or -1 */
+
+  struct file_id_table* fidt; /**< The fileid table of the process, NULL if empty */
+  Mutex fidt_spinlock;    /**< Protects @c fidt against the data path; 
+                               changes also need the kernel lock */
 
 
   //VDK EDIT Phase 2
@@ -85,6 +106,21 @@ typedef struct process_thread_control_block{
     rlnode node;
 }PTCB;
 
+/**
+  @brief Free a PTCB.
+
+  PTCBs are allocated from a slab cache by @c CreateThread, this returns
+  them to it.
+*/
+void release_PTCB(PTCB* ptcb);
+
+/**
+  @brief Free all the PTCBs of a process, and its thread table.
+
+  This is called when the last thread of the process exits.
+*/
+void release_all_PTCBs(PCB* pcb);
+
 /**
   @brief Initialize the process table.
 
@@ -22,6 +22,8 @@
   +-------------+
   |   TCB       |
   +-------------+
+  | guard page  |
+  +-------------+
   |             |
   |    stack    |
   |             |
@@ -33,7 +35,10 @@
 
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
   crash own thread, before it affects other threads (which may make debugging
-  easier).
+  easier). With mmapped thread memory, the guard page is inaccessible, so that
+  an overrun faults at once, before it corrupts the TCB.
+
+  The stack size is chosen per thread (see CreateThreadStack).
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
@@ -53,15 +58,16 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
 #define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
-
-//#define MMAPPED_THREAD_MEM 
+#define MMAPPED_THREAD_MEM 
 #ifdef MMAPPED_THREAD_MEM 
 
+/* The size of the sentinel page below the stack */
+#define THREAD_GUARD_SIZE  SYSTEM_PAGE_SIZE
+
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The "sentinel page" between the TCB and
+  the stack has access PROT_NONE, so that a stack overflow is detected 
+  as seg.fault.
  */
 void free_thread(void* ptr, size_t size)
 {
@@ -76,10 +82,15 @@ void* allocate_thread(size_t size)
       , -1,0);
   
   CHECK((ptr==MAP_FAILED)?-1:0);
+  CHECK(mprotect(ptr+THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
 
   return ptr;
 }
 #else
+
+/* There is no sentinel page in malloc'ed memory */
+#define THREAD_GUARD_SIZE  0
+
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
   be made easily to 'detect' stack overflow.
@@ -97,6 +108,76 @@ void* allocate_thread(size_t size)
 }
 #endif
 
+/* The size of the memory block of a thread with the given stack */
+#define THREAD_SIZE(stack_size)  (THREAD_TCB_SIZE+THREAD_GUARD_SIZE+(stack_size))
+
+
+/*
+  The thread cache.
+  -----------------
+
+  Every core keeps a stack of free thread memory blocks, so that thread 
+  creation and exit do not call the allocator in steady state, and reuse 
+  memory which is already mapped (and probably in the cache). Only the 
+  blocks of threads with the default stack size are cached.
+
+  A core pushes the blocks of the threads that exit on it, up to
+  THREAD_CACHE_HIGH blocks, and frees any more. When it becomes idle, 
+  it trims its cache down to THREAD_CACHE_LOW blocks. 
+
+  The cache of a core is only accessed by that core, with preemption off,
+  so it needs no lock.
+ */
+
+#define THREAD_CACHE_HIGH 16
+#define THREAD_CACHE_LOW 4
+
+struct thread_block {
+  struct thread_block* next;
+};
+
+static void* thread_cache_get()
+{
+  void* ptr = NULL;
+
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+  if(core->thread_cache) {
+    ptr = core->thread_cache;
+    core->thread_cache = core->thread_cache->next;
+    core->thread_cache_count--;
+  }
+  if(preempt) preempt_on;
+
+  return (ptr) ? ptr : allocate_thread(THREAD_SIZE(THREAD_STACK_SIZE));
+}
+
+/* This is called with preemption off */
+static void thread_cache_put(void* ptr)
+{
+  CCB* core = & CURCORE;
+  if(core->thread_cache_count < THREAD_CACHE_HIGH) {
+    struct thread_block* block = (struct thread_block*) ptr;
+    block->next = core->thread_cache;
+    core->thread_cache = block;
+    core->thread_cache_count++;
+  }
+  else
+    free_thread(ptr, THREAD_SIZE(THREAD_STACK_SIZE));
+}
+
+/* Free blocks until at most 'count' remain. This is called with preemption off */
+static void thread_cache_trim(unsigned int count)
+{
+  CCB* core = & CURCORE;
+  while(core->thread_cache_count > count) {
+    struct thread_block* block = core->thread_cache;
+    core->thread_cache = block->next;
+    core->thread_cache_count--;
+    free_thread(block, THREAD_SIZE(THREAD_STACK_SIZE));
+  }
+}
+
 
 
 /*
@@ -119,10 +200,15 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
+  assert(stack_size % SYSTEM_PAGE_SIZE == 0);
+  assert(THREAD_STACK_MIN <= stack_size && stack_size <= THREAD_STACK_MAX);
+
   /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  TCB* tcb = (TCB*) ((stack_size == THREAD_STACK_SIZE) ? thread_cache_get()
+      : allocate_thread(THREAD_SIZE(stack_size)));
+  tcb->stack_size = stack_size;
 
   //VDK EDIT PHASE 2
   /**Increase by 1 every time we create a new thread
@@ -143,6 +229,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->phase = CTX_CLEAN;
   tcb->thread_func = func;
   tcb->wakeup_time = NO_TIMEOUT;
+  tcb->state_spinlock = MUTEX_INIT;
+  tcb->last_core = cpu_core_id;
 
 //  VDK Edit
 //Init prev cause
@@ -160,14 +248,14 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 
 
   /* Compute the stack segment address and size */
-  void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+  void* sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
 
   /* Init the context */
-  cpu_initialize_context(& tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+  cpu_initialize_context(& tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
   tcb->valgrind_stack_id = 
-    VALGRIND_STACK_REGISTER(sp, sp+THREAD_STACK_SIZE);
+    VALGRIND_STACK_REGISTER(sp, sp+stack_size);
 #endif
 
   /* increase the count of active threads */
@@ -180,7 +268,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 
 
 /*
-  This is called with tcb->state_spinlock locked !
+  This is called by gain(), with preemption off.
  */
 void release_TCB(TCB* tcb)
 {
@@ -188,7 +276,10 @@ void release_TCB(TCB* tcb)
   VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);    
 #endif
 
-  free_thread(tcb, THREAD_SIZE);
+  if(tcb->stack_size == THREAD_STACK_SIZE)
+    thread_cache_put(tcb);
+  else
+    free_thread(tcb, THREAD_SIZE(tcb->stack_size));
 
   Mutex_Lock(&active_threads_spinlock);
   active_threads--;
@@ -213,21 +304,30 @@ CCB cctx[MAX_CORES];
 
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHEDQ.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Each core holds its own multilevel ready queue in its CCB, protected by
+  the core's sched_spinlock. A thread is queued on the core it last ran on.
+  When a core finds its own queue empty, it tries to steal a thread from
+  the queue of another core, before giving up and running its idle thread.
+
+  The state of each thread is protected by the thread's own state_spinlock.
+  Also, the scheduler keeps all the sleeping threads with a timeout in
+  TIMEOUT_HEAP, a pairing heap ordered by wakeup time, protected by
+  timeout_spinlock. Insertion is O(1), and removal of the earliest or
+  of any (cancelled) thread is O(log n) amortized.
+
+  Lock order: a thread's state_spinlock is locked before any ready queue
+  or the timeout heap. At most one ready queue is locked at any time.
+  The timeout sweep locks threads out of order, using Mutex_TryLock.
 */
 
+TCB* TIMEOUT_HEAP;				      /* The heap of threads with a timeout */
+Mutex timeout_spinlock = MUTEX_INIT;  /* spinlock for TIMEOUT_HEAP */
 
-//VDK Edit
-rlnode SCHEDQ[SCHED_LEVELS];             /* The scheduler queue */
-rlnode TIMEOUT_LIST;				  /* The list of threads with a timeout */
+/* The earliest wakeup time in TIMEOUT_HEAP, readable without the lock */
+static TimerDuration next_timeout = NO_TIMEOUT;
 
-Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
+/* Number of cores currently sitting in their idle loop */
+static volatile unsigned int idle_cores = 0;
 
 
 /* Interrupt handler for ALARM */
@@ -243,9 +343,88 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Pairing heap helpers for TIMEOUT_HEAP.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+
+/* Link two heaps, returning the new root */
+static TCB* tq_meld(TCB* a, TCB* b)
+{
+  if(a==NULL) return b;
+  if(b==NULL) return a;
+  if(b->wakeup_time < a->wakeup_time) { TCB* t=a; a=b; b=t; }
+
+  /* make b the leftmost child of a */
+  b->tq_prev = a;
+  b->tq_next = a->tq_child;
+  if(a->tq_child) a->tq_child->tq_prev = b;
+  a->tq_child = b;
+  a->tq_next = a->tq_prev = NULL;
+  return a;
+}
+
+/* Meld a list of sibling heaps into one, by the standard two-pass method */
+static TCB* tq_merge_pairs(TCB* first)
+{
+  TCB* pairs = NULL;   /* stack of melded pairs, linked by tq_next */
+
+  while(first) {
+    TCB* a = first;
+    TCB* b = a->tq_next;
+    first = b ? b->tq_next : NULL;
+    a->tq_next = a->tq_prev = NULL;
+    if(b) b->tq_next = b->tq_prev = NULL;
+
+    TCB* ab = tq_meld(a, b);
+    ab->tq_next = pairs;
+    pairs = ab;
+  }
+
+  TCB* root = NULL;
+  while(pairs) {
+    TCB* p = pairs;
+    pairs = p->tq_next;
+    p->tq_next = NULL;
+    root = tq_meld(root, p);
+  }
+  return root;
+}
+
+static void tq_insert(TCB* tcb)
+{
+  tcb->tq_child = tcb->tq_next = tcb->tq_prev = NULL;
+  TIMEOUT_HEAP = tq_meld(TIMEOUT_HEAP, tcb);
+}
+
+static void tq_remove(TCB* tcb)
+{
+  if(tcb == TIMEOUT_HEAP) {
+    TIMEOUT_HEAP = tq_merge_pairs(tcb->tq_child);
+  } else {
+    /* unlink tcb from its parent or left sibling */
+    if(tcb->tq_prev->tq_child == tcb)
+      tcb->tq_prev->tq_child = tcb->tq_next;
+    else
+      tcb->tq_prev->tq_next = tcb->tq_next;
+    if(tcb->tq_next) tcb->tq_next->tq_prev = tcb->tq_prev;
+
+    TIMEOUT_HEAP = tq_meld(TIMEOUT_HEAP, tq_merge_pairs(tcb->tq_child));
+  }
+  tcb->tq_child = tcb->tq_next = tcb->tq_prev = NULL;
+}
+
+static inline void tq_update_next_timeout()
+{
+  __atomic_store_n(& next_timeout, 
+    TIMEOUT_HEAP ? TIMEOUT_HEAP->wakeup_time : NO_TIMEOUT, __ATOMIC_RELAXED);
+}
+
+
+/*
+  Possibly add TCB to the scheduler timeout heap.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
@@ -255,45 +434,97 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
   	TimerDuration curtime = bios_clock();
   	tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
 
-  	/* add to the TIMEOUT_LIST in sorted order */
-  	rlnode* n = TIMEOUT_LIST.next;
-  	for( ; n!=&TIMEOUT_LIST; n=n->next) 
-  		/* skip earlier entries */
-  		if(tcb->wakeup_time < n->tcb->wakeup_time) break;
-  	/* insert before n */
-	rl_splice(n->prev, & tcb->sched_node);
+  	Mutex_Lock(& timeout_spinlock);
+  	tq_insert(tcb);
+  	tq_update_next_timeout();
+	Mutex_Unlock(& timeout_spinlock);
   }
 }
 
 
 /*
-  Add TCB to the end of the scheduler list.
+  Helpers for sched_levelmask.
+*/
+static inline void levelmask_clear_all(sched_levelmask* m)
+{
+  m->summary = 0;
+  for(int w=0; w<SCHED_MASK_WORDS; w++) m->word[w] = 0;
+}
+
+static inline void levelmask_set(sched_levelmask* m, uint level)
+{
+  m->word[level/64] |= (1ull << (level%64));
+  m->summary |= (1ull << (level/64));
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+static inline void levelmask_clear(sched_levelmask* m, uint level)
+{
+  m->word[level/64] &= ~(1ull << (level%64));
+  if(m->word[level/64]==0)
+    m->summary &= ~(1ull << (level/64));
+}
+
+/* Move every level down by one, merging level 1 into level 0 */
+static inline void levelmask_shift_down(sched_levelmask* m)
+{
+  uint64_t low = (m->word[0] & 1ull);
+  m->summary = 0;
+  for(int w=0; w<SCHED_MASK_WORDS; w++) {
+    m->word[w] >>= 1;
+    if(w+1 < SCHED_MASK_WORDS)
+      m->word[w] |= (m->word[w+1] << 63);
+    if(w==0) m->word[0] |= low;
+    if(m->word[w]) m->summary |= (1ull << w);
+  }
+}
+
+/* Return the lowest set level, or -1 if the mask is empty */
+static inline int levelmask_first(sched_levelmask* m)
+{
+  if(m->summary == 0) return -1;
+  int w = __builtin_ctzll(m->summary);
+  return 64*w + __builtin_ctzll(m->word[w]);
+}
+
+
+/*
+  Add TCB to the end of the ready queue of core 'core'.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_queue_add(TCB* tcb, CCB* core)
 {
+  Mutex_Lock(& core->sched_spinlock);
   /* Insert at the end of the scheduling queue list */
-  rlist_push_back(& SCHEDQ[tcb -> priority], & tcb->sched_node);
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+  rlist_push_back(& core->ready_queue[(tcb->priority + core->level_base) % SCHED_LEVELS],
+                  & tcb->sched_node);
+  levelmask_set(& core->ready_mask, tcb->priority);
+  core->ready_count++;
+  Mutex_Unlock(& core->sched_spinlock);
+
+  /* Restart possibly halted cores, so that they can steal the thread */
+  if(idle_cores > 0)
+    cpu_core_restart_one();
 }
 
 
 /*
 	Adjust the state of a thread to make it READY.
 
-    *** MUST BE CALLED WITH sched_spinlock HELD ***	
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD ***	
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from TIMEOUT_HEAP */
 	if(tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(& tcb->sched_node);
+		/* tcb is in TIMEOUT_HEAP, fix it */
+		assert(tcb->state == STOPPED);
+		Mutex_Lock(& timeout_spinlock);
+		tq_remove(tcb);
+		tq_update_next_timeout();
+		Mutex_Unlock(& timeout_spinlock);
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
@@ -302,38 +533,103 @@ static void sched_make_ready(TCB* tcb)
 
 	/* Possibly add to the scheduler queue */
 	if(tcb->phase == CTX_CLEAN) 
-		sched_queue_add(tcb);
+		sched_queue_add(tcb, & cctx[tcb->last_core]);
 }
 
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Wake up the threads in TIMEOUT_HEAP whose timeout has expired.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  In the common case nothing has expired, and this is decided by
+  looking at next_timeout, without locking.
+
+  Here we hold timeout_spinlock and want a thread's state_spinlock, which
+  is against the lock order. Therefore, we only try to lock the thread,
+  and if this fails we leave the rest of the sweep to a later call.
 */
-static TCB* sched_queue_select()
+static void sched_wakeup_expired()
 {
-
-  /* Empty the timeout list up to the current time and wake up each thread */
   TimerDuration curtime = bios_clock();
-  while(! is_rlist_empty(&TIMEOUT_LIST)) {
-  		TCB* tcb = TIMEOUT_LIST.next->tcb;
+
+  if(__atomic_load_n(& next_timeout, __ATOMIC_RELAXED) > curtime)
+    return;
+
+  Mutex_Lock(& timeout_spinlock);
+  while(TIMEOUT_HEAP != NULL) {
+  		TCB* tcb = TIMEOUT_HEAP;
   		if(tcb->wakeup_time > curtime)
   			break;
+  		if(! Mutex_TryLock(& tcb->state_spinlock))
+  			break;
+
+  		/* Unlink the thread here, since we hold timeout_spinlock */
+  		tq_remove(tcb);
+  		tq_update_next_timeout();
+  		tcb->wakeup_time = NO_TIMEOUT;
+  		Mutex_Unlock(& timeout_spinlock);
+
   		sched_make_ready(tcb);
+  		Mutex_Unlock(& tcb->state_spinlock);
+
+  		Mutex_Lock(& timeout_spinlock);
   }
+  Mutex_Unlock(& timeout_spinlock);
+}
 
-  /* Get the head of the SCHEDQ list */
-//  VDK Edit
-    rlnode * sel;
-    for(int i = 0; i<SCHED_LEVELS;i++){
-        if (!is_rlist_empty(& SCHEDQ[i])){
-            sel = rlist_pop_front(& SCHEDQ[i]);
-            return sel->tcb;  /* When the list is empty, this is NULL */
-        }
-    }
-    return NULL;
+
+/*
+  Remove the head of the highest non-empty level of the ready queue
+  of 'core', if any, and return it. Return NULL if the queue is empty.
+
+  The priority of a queued thread may be stale, due to boosts; it is
+  brought up to date here.
+*/
+static TCB* sched_queue_pop(CCB* core)
+{
+  TCB* tcb = NULL;
+
+  Mutex_Lock(& core->sched_spinlock);
+  int level = levelmask_first(& core->ready_mask);
+  if(level >= 0) {
+      rlnode* queue = & core->ready_queue[(level + core->level_base) % SCHED_LEVELS];
+      tcb = rlist_pop_front(queue)->tcb;
+      tcb->priority = level;
+      if(is_rlist_empty(queue))
+          levelmask_clear(& core->ready_mask, level);
+      core->ready_count--;
+  }
+  Mutex_Unlock(& core->sched_spinlock);
+
+  return tcb;
+}
+
+
+/*
+  Select the next thread to run on the current core. First, look
+  into our own ready queue, then try to steal from the other cores.
+  Return NULL if there is no ready thread anywhere.
+*/
+static TCB* sched_queue_select()
+{
+  /* Empty the timeout list up to the current time and wake up each thread */
+  sched_wakeup_expired();
+
+  TCB* tcb = sched_queue_pop(& CURCORE);
+  if(tcb != NULL) return tcb;
+
+  /* Work stealing: visit the other cores, starting with our neighbour */
+  uint ncores = cpu_cores();
+  for(uint i=1; i<ncores; i++) {
+    CCB* victim = & cctx[(cpu_core_id + i) % ncores];
+
+    /* A racy peek, to avoid locking empty queues */
+    if(victim->ready_count == 0) continue;
+
+    tcb = sched_queue_pop(victim);
+    if(tcb != NULL) return tcb;
+  }
+
+  return NULL;
 }
 
 
@@ -348,15 +644,14 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(& sched_spinlock);
+	Mutex_Lock(& tcb->state_spinlock);
 
 	if(tcb->state==STOPPED || tcb->state==INIT) {
 		sched_make_ready(tcb);
 		ret = 1;		
 	}
 
-
-	Mutex_Unlock(& sched_spinlock);
+	Mutex_Unlock(& tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if(oldpre) preempt_on;
@@ -380,7 +675,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
     domain.
    */
   int preempt = preempt_off;
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& tcb->state_spinlock);
 
   /* mark the thread as stopped or exited */
   tcb->state = state;
@@ -392,8 +687,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   /* Release mx */
   if(mx!=NULL) Mutex_Unlock(mx);
 
-  /* Release the schduler spinlock before calling yield() !!! */
-  Mutex_Unlock(& sched_spinlock);
+  /* Release the state spinlock before calling yield() !!! */
+  Mutex_Unlock(& tcb->state_spinlock);
   
   /* call this to schedule someone else */
   yield(cause);
@@ -403,18 +698,24 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
 }
 
 
-void boost(){
-    //fprintf(stdout, "BOOST");
-    rlnode * TEMPNODE;          /* Temp Node*/
-    //for all queues except the first
-    for (int i=1;i<SCHED_LEVELS;i++){
-          //increase priority
-          while(!is_rlist_empty(&SCHEDQ[i])){
-              TEMPNODE = rlist_pop_front(&SCHEDQ[i]);
-              TEMPNODE -> tcb ->priority--;
-              rlist_push_back(&SCHEDQ[TEMPNODE->tcb->priority],TEMPNODE);
-          }
-    }
+/*
+  Raise the priority of every thread in the ready queue of 'core'.
+
+  Logical level 0 is spliced in front of level 1, and level 1 becomes
+  the new level 0 by rotating level_base. The old level 0 becomes the
+  (empty) lowest level. This takes O(1) time, regardless of the number
+  of ready threads.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void boost(CCB* core){
+    uint top = core->level_base;
+    uint next = (top + 1) % SCHED_LEVELS;
+
+    rlist_prepend(&core->ready_queue[next], &core->ready_queue[top]);
+    core->level_base = next;
+
+    levelmask_shift_down(& core->ready_mask);
 }
 
 /* This function is the entry point to the scheduler's context switching */
@@ -427,20 +728,21 @@ void yield(enum SCHED_CAUSE cause)
   int preempt = preempt_off;
 
   TCB* current = CURTHREAD;  /* Make a local copy of current process, for speed */
+  CCB* curcore = & CURCORE;
 
   int current_ready = 0;
 
-  Mutex_Lock(& sched_spinlock);
-
 //VDK Edit
 
 //Boost
-  if(++boost_counter > BOOST){
-      boost_counter = 0;
-      boost();
+  if(++curcore->boost_counter > BOOST){
+      curcore->boost_counter = 0;
+      Mutex_Lock(& curcore->sched_spinlock);
+      boost(curcore);
+      Mutex_Unlock(& curcore->sched_spinlock);
   }
 
-
+  Mutex_Lock(& current->state_spinlock);
 
   switch(cause){
       case SCHED_QUANTUM:  /**< The quantum has expired */
@@ -514,6 +816,8 @@ void yield(enum SCHED_CAUSE cause)
       assert(0);  /* It should not be READY or EXITED ! */
   }
 
+  Mutex_Unlock(& current->state_spinlock);
+
   /* Get next */
   TCB* next = sched_queue_select();
 
@@ -522,15 +826,13 @@ void yield(enum SCHED_CAUSE cause)
     if(current_ready)
       next = current;
     else
-      next = & CURCORE.idle_thread;
+      next = & curcore->idle_thread;
   }
 
   /* ok, link the current and next TCB, for the gain phase */
   current->next = next;
   next->prev = current;
 
-  Mutex_Unlock(& sched_spinlock);
-
   /* Switch contexts */
   if(current!=next) {
     CURTHREAD = next;
@@ -558,34 +860,40 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-  Mutex_Lock(& sched_spinlock);
-
   /* Mark current state */
   TCB* current = CURTHREAD; 
   TCB* prev = current->prev;
 
+  Mutex_Lock(& current->state_spinlock);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
+  current->last_core = cpu_core_id;
+  Mutex_Unlock(& current->state_spinlock);
 
   if(current != prev) {
   	/* Take care of the previous thread */
+    int exited = 0;
+
+    Mutex_Lock(& prev->state_spinlock);
     prev->phase = CTX_CLEAN;
     switch(prev->state) 
     {
       case READY:
-        if(prev->type != IDLE_THREAD) sched_queue_add(prev);
+        if(prev->type != IDLE_THREAD) sched_queue_add(prev, & CURCORE);
         break;
       case EXITED:
-      	release_TCB(prev);
+        exited = 1;
         break;
       case STOPPED:
         break;
       default:
         assert(0);  /* prev->state should not be INIT or RUNNING ! */
     }
-  }
+    Mutex_Unlock(& prev->state_spinlock);
 
-  Mutex_Unlock(& sched_spinlock);
+    if(exited)
+      release_TCB(prev);
+  }
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
@@ -603,31 +911,52 @@ static void idle_thread()
 
   /* We come here whenever we cannot find a ready thread for our core */
   while(active_threads>0) {
+    /* Give back the memory of past thread churn */
+    int preempt = preempt_off;
+    thread_cache_trim(THREAD_CACHE_LOW);
+    if(preempt) preempt_on;
+
+    __atomic_fetch_add(& idle_cores, 1, __ATOMIC_SEQ_CST);
     cpu_core_halt();
+    __atomic_fetch_sub(& idle_cores, 1, __ATOMIC_SEQ_CST);
     yield(SCHED_IDLE);
   }
 
   /* If the idle thread exits here, we are leaving the scheduler! */
+  preempt_off;
+  thread_cache_trim(0);
+  preempt_on;
   bios_cancel_timer();
   cpu_core_restart_all();
 }
 
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
   //VDK Edit
-  //init sched queue
-  for(int i = 0;i<SCHED_LEVELS;i++){
-      rlnode_init(&SCHEDQ[i], NULL);
+  //init the ready queues of all cores
+  for(int c = 0; c<MAX_CORES; c++) {
+    CCB* core = & cctx[c];
+    for(int i = 0;i<SCHED_LEVELS;i++){
+        rlnode_init(&core->ready_queue[i], NULL);
+    }
+    levelmask_clear_all(& core->ready_mask);
+    core->level_base = 0;
+    core->ready_count = 0;
+    //init boost counter
+    core->boost_counter = 0;
+    core->sched_spinlock = MUTEX_INIT;
+    core->thread_cache = NULL;
+    core->thread_cache_count = 0;
   }
-  //init timeout list
-  rlnode_init(&TIMEOUT_LIST, NULL);
 
-  //init boost counter
-  boost_counter = 0;
+  //init timeout heap
+  TIMEOUT_HEAP = NULL;
+  next_timeout = NO_TIMEOUT;
+  idle_cores = 0;
 }
 
 void run_scheduler()
@@ -644,6 +973,8 @@ void run_scheduler()
   curcore->idle_thread.state = RUNNING;
   curcore->idle_thread.phase = CTX_DIRTY;
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+  curcore->idle_thread.state_spinlock = MUTEX_INIT;
+  curcore->idle_thread.last_core = cpu_core_id;
 //  VDK Edit
   curcore->idle_thread.priority = 0;
 
@@ -29,7 +29,6 @@
 //Scheduler Queue Size:
 #define SCHED_LEVELS 14
 #define BOOST 230
-unsigned int boost_counter;
 
 /*****************************
  *
@@ -99,6 +98,7 @@ typedef struct thread_control_block
   PTCB* owner_ptcb;    /**< This is null for the main thread */
 
   cpu_context_t context;     /**< The thread context */
+  size_t stack_size;         /**< The size of the thread stack */
 #ifndef NVALGRIND
     unsigned valgrind_stack_id; /**< This is useful in order to register the thread stack to valgrind */
 
@@ -111,7 +111,15 @@ typedef struct thread_control_block
   void (*thread_func)();   /**< The function executed by this thread */
     TimerDuration wakeup_time; /**< The time this thread will be woken up by the scheduler */
 
+  /* Links of the timeout heap (a pairing heap ordered by @c wakeup_time) */
+  struct thread_control_block * tq_child;  /**< leftmost child in the timeout heap */
+  struct thread_control_block * tq_next;   /**< right sibling in the timeout heap */
+  struct thread_control_block * tq_prev;   /**< left sibling, or parent for a leftmost child */
+
   rlnode sched_node;      /**< node to use when queueing in the scheduler lists */
+  Mutex state_spinlock;   /**< Protects @c state, @c phase and the scheduler links of the thread */
+  uint last_core;         /**< The core this thread last ran on (or was spawned on) */
+
     struct thread_control_block * prev;  /**< previous context */
 
   struct thread_control_block * next;  /**< next context */
@@ -128,6 +136,12 @@ typedef struct thread_control_block
 /** Thread stack size */
 #define THREAD_STACK_SIZE  (128*1024)
 
+/** The smallest thread stack. Interrupt handlers also run on the thread stack. */
+#define THREAD_STACK_MIN  (16*1024)
+
+/** The largest thread stack */
+#define THREAD_STACK_MAX  (64*1024*1024)
+
 
 /************************
  *
@@ -136,9 +150,36 @@ typedef struct thread_control_block
  ************************/
 
 
+/** @brief Words in the second level of a @c sched_levelmask. */
+#define SCHED_MASK_WORDS ((SCHED_LEVELS+63)/64)
+
+_Static_assert(SCHED_LEVELS <= 64*64, "SCHED_LEVELS is too large for sched_levelmask");
+
+/** @brief A bitmap of the non-empty levels of a ready queue.
+
+  Bit @c i of @c word[i/64] is set iff level @c i is non-empty, and
+  bit @c w of @c summary is set iff @c word[w] is non-zero. Therefore, the
+  highest-priority non-empty level is found with two find-first-set operations,
+  for up to 4096 levels.
+ */
+typedef struct sched_levelmask {
+  uint64_t summary;                   /**< Non-zero words of @c word */
+  uint64_t word[SCHED_MASK_WORDS];    /**< One bit per level */
+} sched_levelmask;
+
+
 /** @brief Core control block.
 
-  Per-core info in memory (basically scheduler-related)
+  Per-core info in memory (basically scheduler-related).
+
+  Each core owns a multilevel ready queue, protected by its own
+  @c sched_spinlock. Threads are queued on the core they last ran on,
+  and cores that run out of work steal threads from the queues of
+  other cores, before halting.
+
+  The levels of the ready queue are rotated by a priority boost:
+  logical level @c l lives in @c ready_queue[(l+level_base)%SCHED_LEVELS].
+  The ready mask is kept in logical levels.
  */
 typedef struct core_control_block {
   uint id;                    /**< The core id */
@@ -147,6 +188,16 @@ typedef struct core_control_block {
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+  rlnode ready_queue[SCHED_LEVELS]; /**< The multilevel ready queue of this core */
+  sched_levelmask ready_mask; /**< The non-empty (logical) levels of @c ready_queue */
+  unsigned int level_base;    /**< The index in @c ready_queue of logical level 0 */
+  unsigned int ready_count;   /**< Number of threads in @c ready_queue */
+  unsigned int boost_counter; /**< Yields since the last priority boost */
+  Mutex sched_spinlock;       /**< Protects the ready queue of this core */
+
+  struct thread_block* thread_cache; /**< Free thread memory blocks of this core */
+  unsigned int thread_cache_count;   /**< Number of blocks in @c thread_cache */
+
 } CCB;
  
 
@@ -183,11 +234,13 @@ extern CCB cctx[MAX_CORES];
   @brief Create a new thread.
 
 	This call creates a new thread, initializing and returning its TCB.
-	The thread will belong to process @c pcb and execute @c func.
+	The thread will belong to process @c pcb and execute @c func, on
+  a stack of @c stack_size bytes (a multiple of the page size, between 
+  @c THREAD_STACK_MIN and @c THREAD_STACK_MAX).
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
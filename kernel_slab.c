@@ -0,0 +1,90 @@
+
+#include <assert.h>
+#include "kernel_cc.h"
+#include "kernel_slab.h"
+#include "util.h"
+
+/*
+   The slab layout.
+  ------------------
+
+  A slab is a block of SLAB_SIZE bytes (or more, for large objects),
+  allocated with malloc. The first SLAB_ALIGN bytes link the slab to
+  the other slabs of the cache; the rest is divided into objects.
+
+  +-------------+
+  | next slab   |
+  +-------------+
+  |  object 0   |
+  +-------------+
+  |  object 1   |
+  +-------------+
+  |    ...      |
+  +-------------+
+
+  A free object stores the link to the next free object in its
+  first word.
+ */
+
+/* The space for the slab link, so that the objects stay aligned */
+#define SLAB_HEADER  SLAB_ALIGN
+
+/* Every slab holds at least this many objects */
+#define SLAB_MIN_OBJECTS  8
+
+
+/* Add a new slab to the cache. The cache must be locked. */
+static void slab_grow(slab_cache* cache)
+{
+	size_t size = SLAB_SIZE;
+	if(size < SLAB_HEADER + SLAB_MIN_OBJECTS*cache->objsize)
+		size = SLAB_HEADER + SLAB_MIN_OBJECTS*cache->objsize;
+
+	char* slab = (char*) xmalloc(size);
+	*(void**) slab = cache->slabs;
+	cache->slabs = slab;
+
+	/* Push the objects in reverse, so that they are handed out in address order */
+	size_t n = (size - SLAB_HEADER) / cache->objsize;
+	for(size_t i = n; i > 0; i--) {
+		void* obj = slab + SLAB_HEADER + (i-1)*cache->objsize;
+		*(void**) obj = cache->freelist;
+		cache->freelist = obj;
+	}
+
+	cache->nobjects += n;
+	cache->nfree += n;
+}
+
+
+void* slab_alloc(slab_cache* cache)
+{
+	assert(cache->objsize >= sizeof(void*));
+
+	Mutex_Lock(& cache->lock);
+
+	if(cache->freelist == NULL)
+		slab_grow(cache);
+
+	void* obj = cache->freelist;
+	cache->freelist = *(void**) obj;
+	cache->nfree--;
+
+	Mutex_Unlock(& cache->lock);
+
+	return obj;
+}
+
+
+void slab_free(slab_cache* cache, void* obj)
+{
+	if(obj == NULL) return;
+
+	Mutex_Lock(& cache->lock);
+
+	*(void**) obj = cache->freelist;
+	cache->freelist = obj;
+	cache->nfree++;
+
+	Mutex_Unlock(& cache->lock);
+}
@@ -0,0 +1,103 @@
+/*
+ *  Object cache (slab) allocator
+ *
+ */
+
+
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+
+#include "tinyos.h"
+
+
+/**
+	@file kernel_slab.h
+	@brief A slab allocator for small, fixed-size kernel objects.
+
+	@defgroup slab Slab allocator.
+	@ingroup kernel
+	@brief A slab allocator for small, fixed-size kernel objects.
+
+	A slab cache hands out objects of a single size, carved out of
+	larger memory blocks (slabs). Freed objects are kept in a free list
+	and reused by the next allocation, so that in steady state objects
+	are allocated and freed without calling the system allocator.
+
+	Slabs are never returned to the system; a cache keeps as many objects
+	as were ever in use at the same time.
+
+	A slab cache is defined statically and needs no initialization:
+	@code
+	static slab_cache ptcb_cache = SLAB_CACHE(PTCB);
+
+	PTCB* ptcb = slab_alloc(&ptcb_cache);
+	...
+	slab_free(&ptcb_cache, ptcb);
+	@endcode
+
+	The caches have their own lock, so they can be used with or without
+	the kernel lock, but not from interrupt handlers.
+
+	@{
+*/
+
+
+/** @brief The size of a slab */
+#define SLAB_SIZE  (1<<14)
+
+/** @brief The alignment of the objects of a slab cache */
+#define SLAB_ALIGN  16
+
+
+/**
+	@brief A cache of objects of one size.
+ */
+typedef struct slab_cache
+{
+	size_t objsize;        /**< @brief The size of each object, aligned */
+	Mutex lock;            /**< @brief Protects the cache */
+	void* freelist;        /**< @brief The free objects */
+	void* slabs;           /**< @brief The slabs of the cache */
+	size_t nobjects;       /**< @brief The number of objects in all slabs */
+	size_t nfree;          /**< @brief The number of free objects */
+} slab_cache;
+
+
+/**
+	@brief Initializer for a slab cache with objects of the given size.
+ */
+#define SLAB_CACHE_SIZE(size) ((slab_cache){ \
+	.objsize = (((size)+SLAB_ALIGN-1)/SLAB_ALIGN)*SLAB_ALIGN, \
+	.lock = MUTEX_INIT, .freelist = NULL, .slabs = NULL,  \
+	.nobjects = 0, .nfree = 0 })
+
+/**
+	@brief Initializer for a slab cache of objects of the given type.
+ */
+#define SLAB_CACHE(type)  SLAB_CACHE_SIZE(sizeof(type))
+
+
+/**
+	@brief Allocate an object from a slab cache.
+
+	The contents of the object are undefined. If the cache has no free
+	objects, a new slab is allocated.
+
+	@param cache the slab cache
+	@returns a pointer to the new object
+ */
+void* slab_alloc(slab_cache* cache);
+
+
+/**
+	@brief Return an object to its slab cache.
+
+	@param cache the slab cache the object was allocated from
+	@param obj the object; if @c NULL, nothing is done
+ */
+void slab_free(slab_cache* cache, void* obj);
+
+
+/** @} */
+
+#endif
@@ -3,59 +3,159 @@
 #include "util.h"
 #include "kernel_streams.h"
 #include "kernel_cc.h"
+#include "kernel_slab.h"
 
 
 int socket_read(void* socket, char* buf, unsigned int size);
 int socket_write(void* socket, const char* buf, unsigned int size);
+int socket_readv(void* socket, const iovec_t* iov, unsigned int iovcnt);
+int socket_writev(void* socket, const iovec_t* iov, unsigned int iovcnt);
 int socket_close(void* socket);
+int socket_control(void* socket, stream_control cmd, int arg);
+PIPCB* socket_get_pipe(void* socket, int write);
+int socket_poll(void* socket, int events, struct poll_waiter* w);
 
 int socket_counter = 0;
 
+/* Sockets and connections are allocated from slab caches */
+static slab_cache scb_cache = SLAB_CACHE(SCB);
+static slab_cache conn_cache = SLAB_CACHE(socket_conn);
+
 
 // the socket operations
 static file_ops socket_ops = {
   .Open = NULL,
   .Read = socket_read,
   .Write = socket_write,
-  .Close = socket_close
+  .ReadV = socket_readv,
+  .WriteV = socket_writev,
+  .Close = socket_close,
+  .Control = socket_control,
+  .GetPipe = socket_get_pipe,
+  .Poll = socket_poll
 };
 
 
+/*
+  The port table.
 
-Fid_t sys_Socket(port_t port)
+  PORT_MAP[port] is the list of the LISTENERs of a port. There is at most one,
+  unless all of them have the reuseport flag; then, each Connect is queued at 
+  the LISTENER with the fewest queued connections, and the chosen LISTENER goes 
+  to the back of the list, so that LISTENERs with equal queues take turns.
+  LISTENERs whose queue is as long as their backlog are not chosen.
+
+  Connect does not wait for Accept. It connects the socket at once to a new
+  PEER socket, which has no file id yet, and queues this socket at the 
+  LISTENER. Accept only gives file ids to the queued sockets.
+
+  Ports are few, so the table is indexed directly by port. The lists are 
+  initialized on first use.
+ */
+static rlnode PORT_MAP[MAX_PORT+1];
+
+static rlnode* port_listeners(port_t port)
 {
-  //we want 1 fcb and 1 fid
-  Fid_t fid[1];
-  FCB* fcb[1];
+	rlnode* list = &PORT_MAP[port];
+	if(list->next == NULL)
+		rlnode_init(list, NULL);
+	return list;
+}
 
-  //initialize the ports table only once (when there are no sockets created)
-  if(socket_counter == 0)
-  	initialize_port_map(PORT_MAP);
+//choose the LISTENER of a port that gets the next connection, or NULL if none has room
+static SCB* port_choose_listener(port_t port)
+{
+	rlnode* list = port_listeners(port);
+	SCB* best = NULL;
+
+	for(rlnode* node = list->next; node != list; node = node->next) {
+		SCB* listener = node->scb;
+		if(listener->backlog != 0 && listener->listener_sock.nrequests >= listener->backlog)
+			continue;
+		if(best == NULL || listener->listener_sock.nrequests < best->listener_sock.nrequests)
+			best = listener;
+	}
 
-  //check for illegal port number
-  if(port >= 0 && port <= MAX_PORT)
-  {	
+	if(best != NULL) {
+		rlist_remove(&best->listener_sock.port_node);
+		rlist_push_back(list, &best->listener_sock.port_node);
+	}
+	return best;
+}
 
-  	//create a new socket control block
-  	SCB* scb = (SCB* ) xmalloc(sizeof(SCB));
+//queue a new PEER socket at a LISTENER, until it is accepted
+static void listener_enqueue(SCB* listener, SCB* peer)
+{
+	Mutex_Lock(&listener->spinlock);
+	rlist_push_back(&listener->listener_sock.requestQueue, &peer->peer_sock.accept_node);
+	listener->listener_sock.nrequests++;
+	//the LISTENER may be polled instead of waiting in Accept()
+	poll_wakeup(&listener->pollers);
+	Mutex_Unlock(&listener->spinlock);
+
+	//wake up the listener to accept the new connection
+	kernel_signal(&listener->listener_sock.cv_request);
+}
 
-  	//check if the available file ids for the process are exhausted
-  	if(! FCB_reserve(1, fid, fcb))
-		return NOFILE;
+//drop a reference to a (closed) LISTENER, freeing it with the last one
+static void listener_unref(SCB* listener)
+{
+	if(--listener->ref_counter == 0)
+		slab_free(&scb_cache, listener);
+}
+
+
+
+//create a new UNBOUND socket at a port, without a file id
+static SCB* socket_init(port_t port)
+{
+	//create a new socket control block
+	SCB* scb = (SCB* ) slab_alloc(&scb_cache);
 
 	//-----------------------initialize the scb--------------------------
 	scb->ref_counter = 0;
-	scb->fcb = fcb[0];
-	scb->fid = fid[0];
+	scb->spinlock = MUTEX_INIT;
+	rlnode_init(&scb->pollers, NULL);
+	scb->fcb = NULL;
+	scb->fid = NOFILE;
 	//bound the socket to the specified port
 	scb->port = port;
 	scb->sock_type = UNBOUND;
+	scb->reuseport = 0;
+	scb->message = 0;
+	scb->backlog = DEFAULT_BACKLOG;
+	socket_counter++;
+
+	return scb;
+}
+
+//make a socket the stream of a reserved FCB
+static void socket_attach(SCB* scb, Fid_t fid, FCB* fcb)
+{
+	scb->fcb = fcb;
+	scb->fid = fid;
 
-	//stream functions are the socket operations
-	fcb[0]->streamfunc = &socket_ops;
 	// stream object is the socket control block
-	fcb[0]->streamobj = scb;
-  	socket_counter++;
+	fcb->streamobj = scb;
+	//stream functions are the socket operations
+	fcb->streamfunc = &socket_ops;
+}
+
+
+Fid_t sys_Socket(port_t port)
+{
+  //we want 1 fcb and 1 fid
+  Fid_t fid[1];
+  FCB* fcb[1];
+
+  //check for illegal port number
+  if(port >= 0 && port <= MAX_PORT)
+  {	
+  	//check if the available file ids for the process are exhausted
+  	if(! FCB_reserve(1, fid, fcb))
+		return NOFILE;
+
+	socket_attach(socket_init(port), fid[0], fcb[0]);
 
   	//return a file id for the new socket
   	return fid[0];		
@@ -91,17 +191,23 @@ int sys_Listen(Fid_t sock)
 	if(scb->port > 0 && scb->port < MAX_PORT){
 		//check if the socket isn't already a LISTENER or a PEER 
 		if(scb->sock_type == UNBOUND){
-			//check if another LISTENER is already bound to this port 
-			if(PORT_MAP[scb->port] == NULL){
+			//check if another LISTENER is already bound to this port, unless they all share it
+			rlnode* listeners = port_listeners(scb->port);
+			SCB* other = is_rlist_empty(listeners) ? NULL : listeners->next->scb;
+			if(other == NULL || (scb->reuseport && other->reuseport && scb->message == other->message)){
 
 				//Transform the socket to LISTENER at this port
-				PORT_MAP[scb->port] = scb;
+				Mutex_Lock(&scb->spinlock);
 				scb->sock_type = LISTENER;
 				scb->ref_counter++;
 				//Initialize the cv of the LISTENER
 				scb->listener_sock.cv_request = COND_INIT;
 				//initialize the request queue of the LISTENER
 				rlnode_init(&scb->listener_sock.requestQueue, NULL);
+				scb->listener_sock.nrequests = 0;
+				Mutex_Unlock(&scb->spinlock);
+				rlnode_init(&scb->listener_sock.port_node, scb);
+				rlist_push_back(listeners, &scb->listener_sock.port_node);
 				return 0;
 			}
 			else return -1;
@@ -114,17 +220,20 @@ int sys_Listen(Fid_t sock)
 
 
 
-Fid_t sys_Accept(Fid_t lsock)
+/*
+  Wait until a LISTENER has a queued connection, holding a reference to it.
+  Return 0 if there is a connection, NOFILE if the file id is not a LISTENER 
+  or it was closed while waiting, or WOULDBLOCK.
+ */
+static int listener_wait(Fid_t lsock, SCB** listener)
 {
-	Fid_t listener_fid = lsock;
-
 	//Only values 0 to MAX_FILEID-1 are legal for file descriptors.
-	if(listener_fid < 0 || listener_fid >= MAX_FILEID){
+	if(lsock < 0 || lsock >= MAX_FILEID){
 		return NOFILE;		
 	}
 
 	//get the fcb from the listener_fid
-	FCB* listener_fcb = get_fcb(listener_fid);
+	FCB* listener_fcb = get_fcb(lsock);
 
 	if(listener_fcb == NULL)
 		return NOFILE;
@@ -138,79 +247,144 @@ Fid_t sys_Accept(Fid_t lsock)
 	if(listener_scb->sock_type != LISTENER)
 		return NOFILE;
 
-	//check if the socket is bound to a valid port
-	if(listener_scb->port <= 0 || listener_scb->port > MAX_PORT || PORT_MAP[listener_scb->port]==NULL)
-		return NOFILE;	
+	//a non-blocking LISTENER does not wait for a connection
+	if(listener_fcb->nonblock && is_rlist_empty(&listener_scb->listener_sock.requestQueue))
+		return WOULDBLOCK;
 
-	//sleep the LISTENER until a new request is made
-	while(is_rlist_empty(&listener_scb->listener_sock.requestQueue)){
+	//sleep the LISTENER until a new connection is made, or the LISTENER is closed
+	listener_scb->ref_counter++;
+	while(listener_scb->sock_type == LISTENER && is_rlist_empty(&listener_scb->listener_sock.requestQueue)){
 		kernel_wait(&listener_scb->listener_sock.cv_request,SCHED_PIPE);
 	}
-	//get the request
-	rlnode* request = rlist_pop_front(&listener_scb->listener_sock.requestQueue);
-
-	//find the socket that made the request
-	SCB* socket1_scb = request->req->scb;
-	FCB* socket1_fcb = socket1_scb->fcb;
-
-	//to accept and create the p2p connection: 
-	//create a new socket UNBOUND in the same port
-	Fid_t socket2_fid = sys_Socket(listener_scb->port);
-
-	//get the fcb from the new socket fid
-	FCB* socket2_fcb = get_fcb(socket2_fid);
-
-	if(socket2_fcb == NULL)
+	if(listener_scb->sock_type != LISTENER) {
+		listener_unref(listener_scb);
 		return NOFILE;
+	}
+	listener_scb->ref_counter--;
 
-	//get the scb of the new socket
-	SCB* socket2_scb = socket2_fcb->streamobj;
+	*listener = listener_scb;
+	return 0;
+}
 
-	if(socket2_scb == NULL)
-		return NOFILE;
 
-	//Make both sockets PEERS
-	socket1_scb->sock_type = PEER;
+//connect an UNBOUND socket to a new PEER socket, at the port of a LISTENER
+static SCB* connect_peer(SCB* socket1_scb, SCB* listener_scb)
+{
+	//to create the p2p connection: 
+	//create a new socket in the same port, which gets a file id from Accept
+	SCB* socket2_scb = socket_init(listener_scb->port);
+	socket2_scb->message = listener_scb->message;
+
+	//initialize the connection, with a pipe for each direction and one lock for both.
+	//the FCB of the new socket is set by Accept, only its own reads need it
+	socket_conn* conn = (socket_conn*) slab_alloc(&conn_cache);
+	conn->spinlock = MUTEX_INIT;
+	conn->ref_counter = 2;
+	pipe_init(&conn->pipe[0], NULL, socket1_scb->fcb, &conn->spinlock, NULL);
+	pipe_init(&conn->pipe[1], socket1_scb->fcb, NULL, &conn->spinlock, NULL);
+	conn->pipe[0].message = conn->pipe[1].message = socket2_scb->message;
+
+	//connect the 2 sockets by connecting the 2 pipes, and make both sockets PEERS.
+	//each socket has a pointer to show to the other socket connected to.
+	//Read and Write see the pipes only after they see the PEER type (see socket_get_pipe)
+	socket2_scb->peer_sock.pipe_sender = &conn->pipe[1];
+	socket2_scb->peer_sock.pipe_receiver = &conn->pipe[0];
+	socket2_scb->peer_sock.socket_pointer = socket1_scb;
+	socket2_scb->peer_sock.conn = conn;
+	rlnode_init(&socket2_scb->peer_sock.accept_node, socket2_scb);
 	socket2_scb->sock_type = PEER;
 
-	//Now it's time to connect the 2 sockets
-
-	//initialize 2 pipes
+	Mutex_Lock(&socket1_scb->spinlock);
+	socket1_scb->peer_sock.pipe_sender = &conn->pipe[0];
+	socket1_scb->peer_sock.pipe_receiver = &conn->pipe[1];
+	socket1_scb->peer_sock.socket_pointer = socket2_scb;
+	socket1_scb->peer_sock.conn = conn;
+	rlnode_init(&socket1_scb->peer_sock.accept_node, socket1_scb);
+	__atomic_store_n(&socket1_scb->sock_type, PEER, __ATOMIC_RELEASE);
+	//the connecting socket may be polled, waiting to become a PEER
+	poll_wakeup(&socket1_scb->pollers);
+	Mutex_Unlock(&socket1_scb->spinlock);
+
+	return socket2_scb;
+}
 
-	FCB* fcb1[2];
-	fcb1[0] = socket1_fcb;
-	fcb1[1] = socket2_fcb;
 
-	PIPCB* socket2_pipe = pipe_Init(fcb1);
+//give a reserved fid and FCB to a queued PEER socket
+static void accept_peer(SCB* socket2_scb, Fid_t socket2_fid, FCB* socket2_fcb)
+{
+	socket_attach(socket2_scb, socket2_fid, socket2_fcb);
+
+	//the new socket reads from one pipe and writes to the other
+	socket_conn* conn = socket2_scb->peer_sock.conn;
+	Mutex_Lock(&conn->spinlock);
+	socket2_scb->peer_sock.pipe_receiver->readerFCB = socket2_fcb;
+	socket2_scb->peer_sock.pipe_sender->writerFCB = socket2_fcb;
+	Mutex_Unlock(&conn->spinlock);
+}
 
-	FCB* fcb2[2];
-	fcb2[0] = socket2_fcb;
-	fcb2[1] = socket1_fcb;
 
-	PIPCB* socket1_pipe = pipe_Init(fcb2);
+/* The most connections that are dequeued at once */
+#define ACCEPT_BATCH 32
 
-	//Check if Pipes initialized
-	if(socket2_pipe == NULL || socket1_pipe == NULL)
-		return NOFILE;
+/*
+  Accept up to n connections of a LISTENER, in batches of up to ACCEPT_BATCH. 
+  The fids and FCBs of the new sockets are reserved before the sockets are 
+  dequeued, so that a connection is never dequeued without being accepted.
+ */
+static int accept_many(Fid_t lsock, Fid_t* fids, unsigned int n)
+{
+	SCB* listener_scb;
+	int rc = listener_wait(lsock, &listener_scb);
+	if(rc != 0)
+		return rc;
+
+	unsigned int total = 0;
+	while(total < n && listener_scb->listener_sock.nrequests > 0) {
+
+		//reserve as many fids as there are connections, or as many as are available
+		FCB* fcbs[ACCEPT_BATCH];
+		unsigned int count = listener_scb->listener_sock.nrequests;
+		if(count > n - total) count = n - total;
+		if(count > ACCEPT_BATCH) count = ACCEPT_BATCH;
+		while(! FCB_reserve(count, fids + total, fcbs)) {
+			//check if the available file ids for the process are exhausted
+			if(count == 1)
+				return (total > 0) ? (int) total : NOFILE;
+			count /= 2;
+		}
 
-	//connect the 2 sockets by connecting the 2 pipes
-	socket1_scb->peer_sock.pipe_sender = socket1_pipe;
-	socket1_scb->peer_sock.pipe_receiver = socket2_pipe;
-    socket2_scb->peer_sock.pipe_sender = socket2_pipe;
-	socket2_scb->peer_sock.pipe_receiver = socket1_pipe;
+		//get the connections of the batch, all at once
+		SCB* peers[ACCEPT_BATCH];
+		Mutex_Lock(&listener_scb->spinlock);
+		for(unsigned int i = 0; i < count; i++)
+			peers[i] = rlist_pop_front(&listener_scb->listener_sock.requestQueue)->scb;
+		listener_scb->listener_sock.nrequests -= count;
+		Mutex_Unlock(&listener_scb->spinlock);
+
+		for(unsigned int i = 0; i < count; i++)
+			accept_peer(peers[i], fids[total + i], fcbs[i]);
+		total += count;
+	}
 
-	//each socket has a pointer to show to the other socket connected to
-	socket1_scb->peer_sock.socket_pointer = socket2_scb;
-	socket2_scb->peer_sock.socket_pointer = socket1_scb;
+	return total;
+}
 
 
-	//set request_flag = 1 because the connection was successfull
-	request->req->request_flag = 1;
-	//wake up the request
-	kernel_signal(&request->req->cv);
+Fid_t sys_Accept(Fid_t lsock)
+{
+	Fid_t fid;
+	int rc = accept_many(lsock, &fid, 1);
 
 	//return newly created socket fid
-	return socket2_fid;
+	return (rc == 1) ? fid : rc;
+}
+
+
+int sys_AcceptMany(Fid_t lsock, Fid_t* fids, unsigned int n)
+{
+	if(n == 0 || fids == NULL)
+		return NOFILE;
+	return accept_many(lsock, fids, n);
 }
 
 
@@ -240,42 +414,22 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 
 		//1. Only UNBOUND Sockets can connect to LISTENERS 
 		//2. Check if there is a LISTENER bound on the port we want to establish a connection
-		if(scb->sock_type == !UNBOUND || PORT_MAP[port] == NULL)
+		if(scb->sock_type != UNBOUND)
 			return -1;
 
 		//get the control block of the LISTENER from the port in the ports Table
-		SCB* listener_scb = PORT_MAP[port];
-		//create a queue of requests
-		queue_request* request = (queue_request* ) xmalloc(sizeof(queue_request));
-		//Initialize the control block of the queue holding the requests
-		request->scb = scb;
-		request->cv  = COND_INIT;
-		request->request_flag = 0;
-		rlnode_init(&request->req_queue, request);
-		//insert the new request in the LISTENER's request queue
-		rlist_push_back(&listener_scb->listener_sock.requestQueue, &request->req_queue);
-		listener_scb->ref_counter++;
-
-		//wake up the listener to serve the new request
-		kernel_signal(&listener_scb->listener_sock.cv_request);  //THIS REQUEST MUST BE SERVED FROM THE LISTENER SOCKETS ACCEPT()
-		/*The new request is sleeping until either it is served by the LISTENER or 
-		  the timeout has expired. In this case, the connection has failed. 
-
-		  kernel_timedwait returns 1 for success by signal/broadcast or 0 for failure */
-		int timed_out = kernel_timedwait(&request->cv, SCHED_USER, timeout);
-		//remove the request from the queue because it was served by the LISTENER (either failed or succeeded)
-
-		rlist_remove(&request->req_queue);
-		listener_scb->ref_counter--;
-
-		//check if connection has failed due to timeout expiration
-		if(timed_out == 0)
-		 	return -1;
-		//check if the connection has succeeded
-		if(request->request_flag == 1)
-			return 0;
-		else
+		SCB* listener_scb = port_choose_listener(port);
+		if(listener_scb == NULL)
 			return -1;
+		//the LISTENERs of a port have the same mode, which must be ours
+		if(listener_scb->message != scb->message)
+			return -1;
+
+		/*The connection is made at once, and the other end waits at the LISTENER
+		  for Accept(), so the timeout is not needed. Data can be sent right away*/
+		SCB* peer = connect_peer(scb, listener_scb);
+		listener_enqueue(listener_scb, peer);
+		return 0;
 	}
 	else return -1;
 }
@@ -319,35 +473,49 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 
 int socket_read(void* socket, char* buf, unsigned int size)
 {
-	SCB* scb = (SCB* ) socket;
-	//the number of data that was read
-	int num_of_data = 0;
+	//the pipe responsible for reading data; only peer sockets can read data
+	PIPCB* pipe = socket_get_pipe(socket, 0);
 
-	//Only peer sockets can read data
-	if(scb->sock_type == PEER){
-		//use the pipe responsible for reading data
-		num_of_data = pipe_read(scb->peer_sock.pipe_receiver, buf, size);
-		return num_of_data;
-	}
-	else
+	if(pipe == NULL)
 		return -1;
+
+	return pipe_read(pipe, buf, size);
 }
 
 
 int socket_write(void* socket, const char* buf, unsigned int size)
 {
-	SCB* scb = (SCB* ) socket;
-	//the number of data that was written
-	int num_of_data = 0;
+	//the pipe responsible for writing data; only peer sockets can write data
+	PIPCB* pipe = socket_get_pipe(socket, 1);
 
+	if(pipe == NULL)
+		return -1;
+
+	return pipe_write(pipe, buf, size);
+}
+
+
+int socket_readv(void* socket, const iovec_t* iov, unsigned int iovcnt)
+{
+	//Only peer sockets can read data
+	PIPCB* pipe = socket_get_pipe(socket, 0);
+
+	if(pipe == NULL)
+		return -1;
+
+	return pipe_readv(pipe, iov, iovcnt);
+}
+
+
+int socket_writev(void* socket, const iovec_t* iov, unsigned int iovcnt)
+{
 	//Only peer sockets can write data
-	if(scb->sock_type == PEER){
-		//use the pipe responsible for writing data
-		num_of_data = pipe_write(scb->peer_sock.pipe_sender, buf, size);
-		return num_of_data;
-	}
-	else
+	PIPCB* pipe = socket_get_pipe(socket, 1);
+
+	if(pipe == NULL)
 		return -1;
+
+	return pipe_writev(pipe, iov, iovcnt);
 }
 
 
@@ -360,31 +528,47 @@ int socket_close(void* socket)
 
 	if(scb->sock_type == PEER){
 
+		//close the pipe responsible for writing data
+		pipe_writer_close(scb->peer_sock.pipe_sender);
+		//close the pipe responsible for reading data
+		pipe_reader_close(scb->peer_sock.pipe_receiver);
+
 		//check if this peer socket is connected to another socket 
 		if(scb->peer_sock.socket_pointer != NULL){
-			//close the pipe responsible for writing data
-			pipe_writer_close(scb->peer_sock.pipe_sender);
-			//close the pipe responsible for reading data
-			pipe_reader_close(scb->peer_sock.pipe_receiver);
-			//decrease the reference counter of this socket
-			scb->ref_counter--;
 			//destroy the peer to peer connection 
 			scb->peer_sock.socket_pointer->peer_sock.socket_pointer = NULL;
 		}
+
+		//the connection is freed with the second socket
+		socket_conn* conn = scb->peer_sock.conn;
+		if(--conn->ref_counter == 0)
+			slab_free(&conn_cache, conn);
 	}
 	else if(scb->sock_type == LISTENER){
-		//transform the socket from LISTENER to UNBOUND
-		PORT_MAP[scb->port] = NULL;
+		//transform the socket from LISTENER to UNBOUND, removing it from its port
+		rlist_remove(&scb->listener_sock.port_node);
+		rlnode requests;
+		rlnode_init(&requests, NULL);
+		Mutex_Lock(&scb->spinlock);
+		scb->sock_type = UNBOUND;
+		rlist_append(&requests, &scb->listener_sock.requestQueue);
+		scb->listener_sock.nrequests = 0;
+		Mutex_Unlock(&scb->spinlock);
 		//decrease the reference counter of this socket
 		scb->ref_counter--;
-		//wake up the listener to serve the remaining requests
-		kernel_signal(&scb->listener_sock.cv_request);
-		//while the queue that holds the requests is not empty
-		while(!is_rlist_empty(&scb->listener_sock.requestQueue)){
-			//dequeue a request from the head
-			rlnode* request = rlist_pop_front(&scb->listener_sock.requestQueue);
-			//wake up the request that was sleeping, waiting for a LISTENER  to serve it
-			kernel_signal(&request->req->cv);
+		//wake up the Accept() calls of the listener, they will fail
+		kernel_broadcast(&scb->listener_sock.cv_request);
+
+		//move the queued connections to other LISTENERs of the port, while they have room
+		while(!is_rlist_empty(&requests)){
+			//dequeue a connection from the head
+			SCB* peer = rlist_pop_front(&requests)->scb;
+			SCB* other = port_choose_listener(scb->port);
+			if(other != NULL)
+				listener_enqueue(other, peer);
+			else
+				//close the end that was never accepted; the connecting side sees the end of data
+				socket_close(peer);
 		}
 	}
 	/* If it is an UNBOUND socket, the only thing we need to do is 
@@ -392,7 +576,99 @@ int socket_close(void* socket)
 
 	//only if no sockets observe this socket, we can free its control block
 	if(scb->ref_counter == 0)
-		free(scb);
+		slab_free(&scb_cache, scb);
 
 	return 0;
-}
\ No newline at end of file
+}
+
+
+PIPCB* socket_get_pipe(void* socket, int write)
+{
+	SCB* scb = (SCB* ) socket;
+
+	//a PEER socket receives from one pipe and sends to another. A socket becomes a 
+	//PEER once, after its pipes are set, and stays one until it is closed, so
+	//no lock is needed to find them
+	if(__atomic_load_n(&scb->sock_type, __ATOMIC_ACQUIRE) != PEER)
+		return NULL;
+	return write ? scb->peer_sock.pipe_sender : scb->peer_sock.pipe_receiver;
+}
+
+
+int socket_control(void* socket, stream_control cmd, int arg)
+{
+	SCB* scb = (SCB*) socket;
+
+	switch(cmd){
+		case CTL_GET_REUSEPORT:
+			return scb->reuseport;
+		case CTL_SET_REUSEPORT:
+			//only a socket that does not listen yet may change the flag
+			if(scb->sock_type != UNBOUND)
+				return -1;
+			scb->reuseport = (arg != 0);
+			return 0;
+		case CTL_GET_MESSAGE_MODE:
+			return scb->message;
+		case CTL_SET_MESSAGE_MODE:
+			//the mode of a connection is fixed
+			if(scb->sock_type != UNBOUND)
+				return -1;
+			scb->message = (arg != 0);
+			return 0;
+		case CTL_GET_BACKLOG:
+			return scb->backlog;
+		case CTL_SET_BACKLOG:
+			//a smaller backlog does not drop the requests already queued
+			if(arg < 0)
+				return -1;
+			scb->backlog = arg;
+			return 0;
+		case CTL_GET_PIPE_SIZE:
+		case CTL_SET_PIPE_SIZE:
+			//the pipe size of a PEER socket is the size of the pipe it receives data from
+			if(scb->sock_type != PEER)
+				return -1;
+			return pipe_control(scb->peer_sock.pipe_receiver, cmd, arg);
+		default:
+			return -1;
+	}
+}
+
+
+int socket_poll(void* socket, int events, struct poll_waiter* w)
+{
+	SCB* scb = (SCB*) socket;
+	PIPCB* receiver = NULL;
+	PIPCB* sender = NULL;
+	int r = 0;
+
+	Mutex_Lock(&scb->spinlock);
+	switch(scb->sock_type){
+		case PEER:
+			receiver = scb->peer_sock.pipe_receiver;
+			sender = scb->peer_sock.pipe_sender;
+			break;
+		case LISTENER:
+			//a LISTENER is ready when Accept() will find a request
+			if(!is_rlist_empty(&scb->listener_sock.requestQueue))
+				r = POLL_READ;
+			else if(w)
+				poll_register(w, &scb->pollers, &scb->spinlock);
+			break;
+		default:
+			//an UNBOUND socket waits to become a PEER
+			if(w)
+				poll_register(w, &scb->pollers, &scb->spinlock);
+			break;
+	}
+	Mutex_Unlock(&scb->spinlock);
+
+	//a PEER is as ready as its pipes
+	if(receiver)
+		r |= pipe_reader_poll(receiver, events & POLL_READ, (events & POLL_READ) ? w : NULL);
+	if(sender)
+		r |= pipe_writer_poll(sender, events & POLL_WRITE, (events & POLL_WRITE) ? w : NULL);
+
+	return r;
+}
@@ -5,6 +5,7 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_slab.h"
 
 #define MAX_FILES MAX_PROC
 
@@ -24,11 +25,18 @@ void initialize_files()
 }
 
 
+/*
+  The free list is protected by the kernel lock, which every caller 
+  (FCB_reserve and fcb_close) already holds.
+ */
 FCB* acquire_FCB()
 {
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
+    fcb->nonblock = 0;
     return fcb;
   }
   else
@@ -41,41 +49,208 @@ void release_FCB(FCB* fcb)
 }
 
 
+/*
+  The reference count of an FCB is changed with atomic operations, since
+  the data path takes and drops references without any lock.
+ */
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_fetch_add(& fcb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference, returning 1 if it was the last one */
+static int fcb_unref(FCB* fcb)
+{
+  uint old = __atomic_fetch_sub(& fcb->refcount, 1, __ATOMIC_ACQ_REL);
+  assert(old > 0);
+  return old == 1;
+}
+
+/* Close the stream of an unreferenced FCB and release it */
+static int fcb_close(FCB* fcb)
+{
+  int retval = fcb->streamfunc->Close(fcb->streamobj);
+  release_FCB(fcb);
+  return retval;
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
-    release_FCB(fcb);
-    return retval;
-  }
+  if(fcb_unref(fcb))
+    return fcb_close(fcb);
   else
     return 0;
 }
 
 
 
+/*
+  File id tables.
+
+  The file id table of a process is shared with its parent (and its 
+  siblings) until one of them modifies it. Before any change, a process
+  makes a private copy of a shared table. Since the table of a process 
+  is replaced only under its fidt_spinlock, and a shared table does not 
+  change, the data path can read the table under the fidt_spinlock alone.
+
+  The array of FCBs starts with FIDT_INITIAL_SIZE entries and doubles as
+  needed, up to MAX_FILEID. The free fids are found with a two-level bitmap:
+  bit f of used[] is set when fid f is taken, and bit w of full is set when
+  used[w] is all ones. Thus, the lowest free fid is found in constant time.
+
+  All the changes are made with the kernel lock held.
+ */
+
+_Static_assert(MAX_FILEID % 64 == 0 && FIDT_WORDS <= 64, "MAX_FILEID must be a multiple of 64, up to 64*64");
+
+static slab_cache fidt_cache = SLAB_CACHE(FIDT);
+
+/* Return the FCB of a fid in a table, or NULL */
+static inline FCB* fidt_get(FIDT* fidt, Fid_t fid)
+{
+  return (fidt == NULL || fid >= fidt->size) ? NULL : fidt->fcb[fid];
+}
+
+/* Return the lowest free fid of a table, or NOFILE */
+static Fid_t fidt_lowest_free(FIDT* fidt)
+{
+  if(~fidt->full == 0) return NOFILE;
+  unsigned int w = __builtin_ctzll(~fidt->full);
+  return 64*w + __builtin_ctzll(~fidt->used[w]);
+}
+
+/* Mark a fid as taken or free in the bitmap */
+static void fidt_mark(FIDT* fidt, Fid_t fid, int taken)
+{
+  unsigned int w = fid / 64;
+  uint64_t bit = ((uint64_t)1) << (fid % 64);
+
+  if(taken) {
+    fidt->used[w] |= bit;
+    if(~fidt->used[w] == 0) fidt->full |= ((uint64_t)1) << w;
+  } else {
+    fidt->used[w] &= ~bit;
+    fidt->full &= ~(((uint64_t)1) << w);
+  }
+}
+
+/* Allocate the FCB array of a table, with a copy of the first n entries of old */
+static FCB** fidt_array(unsigned int size, FCB** old, unsigned int n)
+{
+  FCB** fcb = (FCB**) xmalloc(size*sizeof(FCB*));
+  if(n > 0) memcpy(fcb, old, n*sizeof(FCB*));
+  memset(fcb+n, 0, (size-n)*sizeof(FCB*));
+  return fcb;
+}
+
+/* Grow the FCB array of the table of a process, to hold the given fid */
+static void fidt_grow(PCB* pcb, FIDT* fidt, Fid_t fid)
+{
+  unsigned int size = fidt->size;
+  while(size <= fid) size *= 2;
+  if(size > MAX_FILEID) size = MAX_FILEID;
+
+  FCB** fcb = fidt_array(size, fidt->fcb, fidt->size);
+  FCB** old = fidt->fcb;
+
+  Mutex_Lock(& pcb->fidt_spinlock);
+  fidt->fcb = fcb;
+  fidt->size = size;
+  Mutex_Unlock(& pcb->fidt_spinlock);
+
+  free(old);
+}
+
+/* Set the FCB of a fid in the (private) table of a process */
+static void fidt_set(PCB* pcb, FIDT* fidt, Fid_t fid, FCB* fcb)
+{
+  if(fid >= fidt->size) {
+    if(fcb == NULL) return;
+    fidt_grow(pcb, fidt, fid);
+  }
+  fidt_mark(fidt, fid, fcb != NULL);
+
+  Mutex_Lock(& pcb->fidt_spinlock);
+  fidt->fcb[fid] = fcb;
+  Mutex_Unlock(& pcb->fidt_spinlock);
+}
+
+/* Drop a reference to a table, releasing its FCBs with the last one */
+static void fidt_unref(FIDT* fidt)
+{
+  assert(fidt->refcount > 0);
+  if(--fidt->refcount > 0) return;
+
+  for(unsigned int i=0; i<fidt->size; i++)
+    if(fidt->fcb[i] != NULL)
+      FCB_decref(fidt->fcb[i]);
+  free(fidt->fcb);
+  slab_free(&fidt_cache, fidt);
+}
+
+/* Return the table of a process, after copying it if it is shared (or creating it) */
+static FIDT* fidt_writable(PCB* pcb)
+{
+  FIDT* fidt = pcb->fidt;
+  if(fidt != NULL && fidt->refcount == 1) 
+    return fidt;
+
+  FIDT* copy = (FIDT*) slab_alloc(&fidt_cache);
+  copy->refcount = 1;
+  if(fidt == NULL) {
+    copy->size = FIDT_INITIAL_SIZE;
+    copy->fcb = fidt_array(copy->size, NULL, 0);
+    copy->full = (FIDT_WORDS == 64) ? 0 : ~(uint64_t)0 << FIDT_WORDS;
+    memset(copy->used, 0, sizeof(copy->used));
+  } else {
+    copy->size = fidt->size;
+    copy->fcb = fidt_array(copy->size, fidt->fcb, fidt->size);
+    copy->full = fidt->full;
+    memcpy(copy->used, fidt->used, sizeof(copy->used));
+    for(unsigned int i=0; i<copy->size; i++)
+      if(copy->fcb[i] != NULL)
+        FCB_incref(copy->fcb[i]);
+  }
+
+  Mutex_Lock(& pcb->fidt_spinlock);
+  pcb->fidt = copy;
+  Mutex_Unlock(& pcb->fidt_spinlock);
+
+  /* The old table is still shared, so this is not the last reference */
+  if(fidt != NULL) 
+    fidt_unref(fidt);
+
+  return copy;
+}
+
+void FIDT_inherit(PCB* newproc, PCB* parent)
+{
+  assert(newproc->fidt == NULL);
+  newproc->fidt = parent->fidt;
+  if(newproc->fidt != NULL)
+    newproc->fidt->refcount++;
+}
+
+void FIDT_release(PCB* pcb)
+{
+  Mutex_Lock(& pcb->fidt_spinlock);
+  FIDT* fidt = pcb->fidt;
+  pcb->fidt = NULL;
+  Mutex_Unlock(& pcb->fidt_spinlock);
+
+  if(fidt != NULL)
+    fidt_unref(fidt);
+}
+
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
-    size_t f=0;
     uint i;
 
-    /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
-    }
-    if(i<num) return 0;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -88,10 +263,29 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	}
 	return 0;
     }
+
+    /* Find distinct fids, the lowest free ones */
+    FIDT* fidt = fidt_writable(cur);
+    for(i=0; i<num; i++) {
+	fid[i] = fidt_lowest_free(fidt);
+	if(fid[i] == NOFILE) break;
+	fidt_mark(fidt, fid[i], 1);
+    }
+    if(i<num) {
+	/* Roll back */
+	while(i>0) {
+	    fidt_mark(fidt, fid[i-1], 0);
+	    i--;
+	}
+	for(i=0;i<num;i++)
+	    release_FCB(fcb[i]);
+	return 0;
+    }
+
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
+	fidt_set(cur, fidt, fid[i], fcb[i]);
     }
     return 1;
 }
@@ -101,11 +295,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    FIDT* fidt = fidt_writable(cur);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
-	release_FCB(fcb[i]);
+	assert(fidt_get(fidt, fid[i])==fcb[i]);
+	fidt_set(cur, fidt, fid[i], NULL);
     }
+    for(size_t i=0; i<num ; i++)
+	release_FCB(fcb[i]);
 }
 
 
@@ -124,75 +320,397 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  return fidt_get(CURPROC->fidt, fid);
+}
+
+
+/*
+  The data path.
+
+  These routines run without the kernel lock. The FCB is looked up
+  and referenced under the fidt_spinlock of the process, so that a 
+  concurrent Close() or Dup2() by another thread cannot release it 
+  under our feet.
+ */
+
+/* Look up fid and take a reference to its FCB, or return NULL */
+static FCB* fcb_get(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->fidt_spinlock);
+  FCB* fcb = fidt_get(cur->fidt, fid);
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(& cur->fidt_spinlock);
+
+  return fcb;
+}
+
+/* 
+  Drop a reference taken by fcb_get(). If this was the last reference
+  (the fid was closed in the meantime), the stream is closed here, under 
+  the kernel lock.
+*/
+static void fcb_put(FCB* fcb)
+{
+  if(fcb_unref(fcb)) {
+    kernel_lock();
+    fcb_close(fcb);
+    kernel_unlock();
+  }
+}
+
+
+/* 
+  Non-blocking mode. Pipes and sockets (the streams with GetPipe) check the 
+  flag of their FCB when they would wait. For other streams, we check with 
+  Poll before the call.
+ */
+static int fcb_would_block(FCB* fcb, int events)
+{
+  if(! fcb->nonblock || fcb->streamfunc->GetPipe || fcb->streamfunc->Poll == NULL) 
+    return 0;
+  return ! (fcb->streamfunc->Poll(fcb->streamobj, events, NULL) & (events|POLL_HANGUP));
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* make sure that the stream will not be closed (by another thread) 
+     while we are using it! */
+  FCB* fcb = fcb_get(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    if(fcb->streamfunc && fcb->streamfunc->Read)
+      retcode = fcb_would_block(fcb, POLL_READ) ? WOULDBLOCK
+        : fcb->streamfunc->Read(fcb->streamobj, buf, size);
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    if(devread)
-      retcode = devread(sobj, buf, size);
+    /* Need to decrease the reference to FCB */
+    fcb_put(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_Write(Fid_t fd, const char *buf, unsigned int size)
+{
+  int retcode = -1;
+
+  /* make sure that the stream will not be closed (by another thread) 
+     while we are using it! */
+  FCB* fcb = fcb_get(fd);
+
+  if(fcb) {
+    if(fcb->streamfunc && fcb->streamfunc->Write)
+      retcode = fcb_would_block(fcb, POLL_WRITE) ? WOULDBLOCK
+        : fcb->streamfunc->Write(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
-    FCB_decref(fcb);
+    fcb_put(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
 
+  return retcode;
+}
+
+
+/* ReadV with Read: read into a kernel buffer, then scatter */
+static int readv_copy(FCB* fcb, const iovec_t* iov, unsigned int iovcnt)
+{
+  /* Cap the size while summing, so that it cannot wrap around */
+  unsigned int size = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len >= BUFFER_SIZE - size) { size = BUFFER_SIZE; break; }
+    size += iov[i].len;
+  }
+  if(size == 0) return 0;
+
+  char* buf = (char*) xmalloc(size);
+  int retcode = fcb->streamfunc->Read(fcb->streamobj, buf, size);
+
+  unsigned int pos = 0;
+  for(unsigned int i=0; i<iovcnt && retcode>0 && pos<retcode; i++) {
+    unsigned int n = retcode - pos;
+    if(n > iov[i].len) n = iov[i].len;
+    memcpy(iov[i].base, buf+pos, n);
+    pos += n;
+  }
+  free(buf);
 
   return retcode;
 }
 
+/* WriteV with Write: write each buffer, stopping at the first short write */
+static int writev_copy(FCB* fcb, const iovec_t* iov, unsigned int iovcnt)
+{
+  int written = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = fcb->streamfunc->Write(fcb->streamobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (written > 0) ? written : rc;
+    written += rc;
+    if(rc < iov[i].len) break;
+  }
+  return written;
+}
 
-int sys_Write(Fid_t fd, const char *buf, unsigned int size)
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = fcb_get(fd);
 
   if(fcb) {
+    if(fcb->streamfunc && (fcb->streamfunc->ReadV || fcb->streamfunc->Read)
+        && fcb_would_block(fcb, POLL_READ))
+      retcode = WOULDBLOCK;
+    else if(fcb->streamfunc && fcb->streamfunc->ReadV)
+      retcode = fcb->streamfunc->ReadV(fcb->streamobj, iov, iovcnt);
+    else if(fcb->streamfunc && fcb->streamfunc->Read)
+      retcode = readv_copy(fcb, iov, iovcnt);
+
+    fcb_put(fcb);
+  }
 
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
+  return retcode;
+}
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
 
-    if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
 
-    /* Need to decrease the reference to FCB */
-    FCB_decref(fcb);
+  FCB* fcb = fcb_get(fd);
+
+  if(fcb) {
+    if(fcb->streamfunc && (fcb->streamfunc->WriteV || fcb->streamfunc->Write)
+        && fcb_would_block(fcb, POLL_WRITE))
+      retcode = WOULDBLOCK;
+    else if(fcb->streamfunc && fcb->streamfunc->WriteV)
+      retcode = fcb->streamfunc->WriteV(fcb->streamobj, iov, iovcnt);
+    else if(fcb->streamfunc && fcb->streamfunc->Write)
+      retcode = writev_copy(fcb, iov, iovcnt);
+
+    fcb_put(fcb);
+  }
+
+  return retcode;
+}
+
+
+/* 
+  Splice through a kernel buffer, for streams which are not pipes.
+  The data read from 'in' is written to 'out' until 'out' has accepted 
+  all of it, or a Write fails or accepts nothing. The data not accepted
+  cannot be given back to 'in', so it is lost. The return value is the 
+  number of bytes accepted by 'out' (or the error of its first Write).
+ */
+static int splice_copy(FCB* in, FCB* out, unsigned int size)
+{
+  if(size > BUFFER_SIZE) size = BUFFER_SIZE;
+
+  char* buf = (char*) xmalloc(size);
+  int nread = in->streamfunc->Read(in->streamobj, buf, size);
+  int retcode = nread;
+  if(nread > 0) {
+    int nwritten = 0;
+    while(nwritten < nread) {
+      int rc = out->streamfunc->Write(out->streamobj, buf+nwritten, nread-nwritten);
+      if(rc <= 0) {
+        if(nwritten == 0) nwritten = rc;
+        break;
+      }
+      nwritten += rc;
+    }
+    retcode = nwritten;
+  }
+  free(buf);
+
+  return retcode;
+}
+
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int size)
+{
+  int retcode = -1;
 
+  FCB* fin = fcb_get(in);
+  FCB* fout = fcb_get(out);
+
+  if(fin && fout && fin->streamfunc && fout->streamfunc
+      && fin->streamfunc->Read && fout->streamfunc->Write) {
+
+    /* A stream with pipes, which has no pipe in the needed direction 
+       (e.g., the write end of a pipe as 'in'), cannot be spliced */
+    int in_pipe = (fin->streamfunc->GetPipe != NULL);
+    int out_pipe = (fout->streamfunc->GetPipe != NULL);
+    PIPCB* from = in_pipe ? fin->streamfunc->GetPipe(fin->streamobj, 0) : NULL;
+    PIPCB* to = out_pipe ? fout->streamfunc->GetPipe(fout->streamobj, 1) : NULL;
+
+    if((in_pipe && from==NULL) || (out_pipe && to==NULL))
+      retcode = -1;
+    else if(size == 0)
+      retcode = 0;
+    else if(fcb_would_block(fin, POLL_READ) || fcb_would_block(fout, POLL_WRITE))
+      retcode = WOULDBLOCK;
+    else if(from && to)
+      retcode = pipe_splice(from, to, size);
+    else
+      retcode = splice_copy(fin, fout, size);
   }
 
+  if(fin) fcb_put(fin);
+  if(fout) fcb_put(fout);
 
   return retcode;
 }
 
 
+/*
+  Readiness multiplexing.
+
+  A Poll call first checks all its streams without registering. If none
+  is ready, it checks them again, registering a poll_waiter with the 
+  pollers list of every stream object it checks; a stream whose readiness 
+  changes calls poll_wakeup() on its list, which sets the waiter ready. 
+  Since the check and the registration are done atomically under the 
+  lock of each stream object, no change can be missed.
+
+  The waiter lock may be taken by an interrupt handler (the serial driver),
+  so it is only held with preemption off.
+ */
+
+void poll_register(poll_waiter* w, rlnode* pollers, Mutex* lock)
+{
+  assert(w->nentries < w->maxentries);
+  poll_entry* e = & w->entries[w->nentries++];
+  e->lock = lock;
+  e->waiter = w;
+  rlnode_init(& e->node, e);
+  rlist_push_back(pollers, & e->node);
+}
+
+
+void poll_wakeup(rlnode* pollers)
+{
+  for(rlnode* p = pollers->next; p != pollers; p = p->next) {
+    poll_waiter* w = ((poll_entry*) p->obj)->waiter;
+    int pre = preempt_off;
+    Mutex_Lock(& w->lock);
+    if(! w->ready) {
+      w->ready = 1;
+      Cond_Signal(& w->ready_cv);
+    }
+    Mutex_Unlock(& w->lock);
+    if(pre) preempt_on;
+  }
+}
+
+
+/* Remove all the registrations of a waiter */
+static void poll_unregister_all(poll_waiter* w)
+{
+  int pre = preempt_off;
+  for(unsigned int i=0; i<w->nentries; i++) {
+    poll_entry* e = & w->entries[i];
+    Mutex_Lock(e->lock);
+    rlist_remove(& e->node);
+    Mutex_Unlock(e->lock);
+  }
+  if(pre) preempt_on;
+  w->nentries = 0;
+}
+
+
+/* Check every entry, registering w if it is not NULL. Return the number of ready entries. */
+static int poll_check(pollfd_t* fds, unsigned int nfds, FCB** fcbs, poll_waiter* w)
+{
+  int nready = 0;
+  for(unsigned int i=0; i<nfds; i++) {
+    int r;
+    if(fds[i].fd == NOFILE) 
+      r = 0;
+    else if(fcbs[i] == NULL || fcbs[i]->streamfunc == NULL)
+      r = POLL_INVALID;
+    else if(fcbs[i]->streamfunc->Poll == NULL)
+      r = fds[i].events & (POLL_READ|POLL_WRITE);
+    else
+      r = fcbs[i]->streamfunc->Poll(fcbs[i]->streamobj, fds[i].events, w);
+
+    fds[i].revents = r & (fds[i].events | POLL_HANGUP | POLL_INVALID);
+    if(fds[i].revents) nready++;
+  }
+  return nready;
+}
+
+
+int sys_Poll(pollfd_t* fds, unsigned int nfds, timeout_t timeout)
+{
+  if(fds == NULL || nfds == 0)
+    return -1;
+
+  /* Hold a reference to every stream while polling */
+  FCB** fcbs = (FCB**) xmalloc(nfds*sizeof(FCB*));
+  for(unsigned int i=0; i<nfds; i++)
+    fcbs[i] = (fds[i].fd == NOFILE) ? NULL : fcb_get(fds[i].fd);
+
+  int nready = poll_check(fds, nfds, fcbs, NULL);
+
+  if(nready == 0 && timeout != 0) {
+    /* Every object registers at most two pollers lists */
+    poll_waiter w = { 
+      .lock = MUTEX_INIT, .ready_cv = COND_INIT, .ready = 0, 
+      .entries = (poll_entry*) xmalloc(2*nfds*sizeof(poll_entry)),
+      .nentries = 0, .maxentries = 2*nfds 
+    };
+
+    int forever = (timeout == (timeout_t)-1);
+    TimerDuration deadline = bios_clock() + timeout*1000ul;
+
+    while(1) {
+      nready = poll_check(fds, nfds, fcbs, &w);
+
+      if(nready == 0) {
+        int pre = preempt_off;
+        Mutex_Lock(& w.lock);
+        while(! w.ready) {
+          TimerDuration now = bios_clock();
+          if(forever) 
+            kernel_mxwait(& w.lock, & w.ready_cv, SCHED_POLL);
+          else if(now < deadline)
+            kernel_mxtimedwait(& w.lock, & w.ready_cv, SCHED_POLL, deadline-now);
+          else
+            break;
+        }
+        w.ready = 0;
+        Mutex_Unlock(& w.lock);
+        if(pre) preempt_on;
+      }
+
+      poll_unregister_all(&w);
+
+      if(nready > 0) break;
+
+      /* Something changed, or the timeout expired: check again */
+      nready = poll_check(fds, nfds, fcbs, NULL);
+      if(nready > 0 || (!forever && bios_clock() >= deadline)) break;
+    }
+
+    free(w.entries);
+  }
+
+  for(unsigned int i=0; i<nfds; i++)
+    if(fcbs[i]) fcb_put(fcbs[i]);
+  free(fcbs);
+
+  return nready;
+}
+
+
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
@@ -200,7 +718,7 @@ int sys_Close(int fd)
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    fidt_set(CURPROC, fidt_writable(CURPROC), fd, NULL);
     retcode = FCB_decref(fcb);    
   }
 
@@ -228,10 +746,10 @@ int sys_Dup2(int oldfd, int newfd)
     retcode = -1;
   }
   else if(old!=new) {
+    FCB_incref(old);
+    fidt_set(CURPROC, fidt_writable(CURPROC), newfd, old);
     if(new)
       FCB_decref(new);
-    FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
   }
 
   return retcode;
@@ -239,6 +757,32 @@ int sys_Dup2(int oldfd, int newfd)
 
 
 
+int sys_StreamControl(Fid_t fd, stream_control cmd, int arg)
+{
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb == NULL)
+    return -1;
+
+  /* The mode of the FCB, for all streams */
+  switch(cmd) {
+    case CTL_GET_NONBLOCK:
+      return fcb->nonblock;
+    case CTL_SET_NONBLOCK:
+      fcb->nonblock = (arg != 0);
+      return 0;
+    default:
+      break;
+  }
+
+  if(fcb->streamfunc->Control == NULL)
+    return -1;
+
+  return fcb->streamfunc->Control(fcb->streamobj, cmd, arg);
+}
+
+
+
 unsigned int sys_GetTerminalDevices()
 {
   return device_no(DEV_SERIAL);
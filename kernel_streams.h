@@ -27,6 +27,14 @@
 	object, which provides pointers to device-specific implementations
 	for read, write and close.
 
+	The data path (@c Read and @c Write) runs without the kernel lock.
+	It looks up the FCB under the @c fidt_spinlock of the PCB, and holds
+	a reference to it for the duration of the call (reference counts
+	are atomic). The stream object methods @c Read and @c Write must do 
+	their own locking; all other methods (including @c Close) are called 
+	with the kernel lock held. The lock order is: kernel lock, PCB 
+	@c fidt_spinlock, stream object lock.
+
 	@{
 */
 
@@ -40,14 +48,44 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, changed atomically */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  int nonblock;				/**< @brief Set for non-blocking I/O (see @c CTL_SET_NONBLOCK) */
   rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
 
 
+/** @brief The initial number of entries of a file id table */
+#define FIDT_INITIAL_SIZE 16
+
+/** @brief The number of words in the bitmap of a file id table */
+#define FIDT_WORDS (MAX_FILEID/64)
+
+/** @brief The file id table of a process.
+
+	The table maps file ids to FCBs. A new process shares the table of
+	its parent, and the table is copied only when one of the processes 
+	sharing it modifies it (copy-on-write), so that @c Exec and @c Exit 
+	do not need to touch every file id. A shared table is never modified. 
+
+	The array of FCBs grows on demand, up to @c MAX_FILEID entries, and
+	a bitmap of the taken file ids finds the lowest free one quickly.
+
+	Each non-NULL entry holds a reference to its FCB. The @c refcount
+	is protected by the kernel lock.
+ */
+typedef struct file_id_table
+{
+  uint refcount;			/**< @brief The number of processes sharing the table */
+  uint size;				/**< @brief The number of entries in @c fcb */
+  FCB** fcb;				/**< @brief The FCBs, indexed by file id */
+  uint64_t full;			/**< @brief Bit w is set when @c used[w] is full */
+  uint64_t used[FIDT_WORDS];	/**< @brief Bit f is set when file id f is taken */
+} FIDT;
+
+
 /** 
   @brief Initialization for files and streams.
 
@@ -118,15 +156,84 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Give a new process the file ids of its parent.
+
+	The new process shares the file id table of the parent, until 
+	either of them modifies it. This must be called with the kernel 
+	lock held.
+
+	@param newproc the new process, which has no file ids
+	@param parent the parent process
+ */
+void FIDT_inherit(PCB* newproc, PCB* parent);
+
+
+/** @brief Release the file ids of an exiting process.
+
+	The process loses its file id table, and if no other process
+	shares it, all its FCBs are released. This must be called with 
+	the kernel lock held.
+
+	@param pcb the exiting process
+ */
+void FIDT_release(PCB* pcb);
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	It must be called with the kernel lock held.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
+/** @brief A registration of a @c Poll call with a stream object.
+
+  Stream objects keep a list of @c poll_entry nodes (their pollers), 
+  protected by some lock of the object.
+ */
+typedef struct poll_entry {
+  rlnode node;                  /**< @brief Node in the pollers list of the object */
+  Mutex* lock;                  /**< @brief The lock of that list */
+  struct poll_waiter* waiter;   /**< @brief The waiting @c Poll call */
+} poll_entry;
+
+
+/** @brief The state of a waiting @c Poll call. */
+typedef struct poll_waiter {
+  Mutex lock;                   /**< @brief Protects @c ready */
+  CondVar ready_cv;             /**< @brief Signalled when @c ready is set */
+  int ready;                    /**< @brief Set when some polled object changes */
+  poll_entry* entries;          /**< @brief The registrations of this call */
+  unsigned int nentries;        /**< @brief Used entries */
+  unsigned int maxentries;      /**< @brief Size of @c entries */
+} poll_waiter;
+
+
+/** @brief Register a waiting @c Poll call with a list of pollers.
+
+  This is called by @c Poll methods of streams, with @c lock (the lock 
+  of the @c pollers list) held.
+
+  @param w the waiter
+  @param pollers the list of pollers of the stream object
+  @param lock the lock protecting @c pollers
+ */
+void poll_register(poll_waiter* w, rlnode* pollers, Mutex* lock);
+
+
+/** @brief Wake up the pollers of a stream object.
+
+  This is called by streams when their readiness changes, with 
+  the lock of the @c pollers list held. It may be called from an 
+  interrupt handler.
+
+  @param pollers the list of pollers
+ */
+void poll_wakeup(rlnode* pollers);
+
 /** @} */
 
 #endif
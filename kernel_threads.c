@@ -5,55 +5,104 @@
 //VDK Edit
 //We include that file to use kernel functions
 #include "kernel_cc.h"
-
-//VDK Edit
-/* The memory allocated for the PTCB must be a multiple of SYSTEM_PAGE_SIZE */
-#define THREAD_PTCB_SIZE   (((sizeof(PTCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
+#include "kernel_slab.h"
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE  (1<<12)
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* PTCBs are small, they are allocated from a slab cache */
+static slab_cache ptcb_cache = SLAB_CACHE(PTCB);
+
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  The thread table.
+  -----------------
+
+  Thread ids are handles into the thread table of the process. The low 
+  TID_INDEX_BITS of a Tid_t hold the index of the slot plus one (so that 
+  no thread id is NOTHREAD), and the rest hold the generation of the slot.
+  Thus, validating a thread id takes constant time, and a stale thread id
+  does not match a new thread in the same slot.
+
+  The table grows by doubling, and its free slots form a list.
  */
-void free_PTCB(void* ptr, size_t size)
+#define TID_INDEX_BITS  20
+#define TID_INDEX_MASK  ((((Tid_t)1)<<TID_INDEX_BITS)-1)
+#define TID_GEN_MASK    (((Tid_t)-1)>>TID_INDEX_BITS)
+
+#define THREAD_TABLE_INITIAL_SIZE 16
+
+/* Put a PTCB into a free slot, and return its thread id, or NOTHREAD if the table is full */
+static Tid_t thread_table_insert(PCB* pcb, PTCB* ptcb)
 {
-  CHECK(munmap(ptr, size));
+	if(pcb->thread_table_free < 0) {
+		uint oldsize = pcb->thread_table_size;
+		uint newsize = (oldsize == 0) ? THREAD_TABLE_INITIAL_SIZE : 2*oldsize;
+		if(newsize > TID_INDEX_MASK) newsize = TID_INDEX_MASK;
+		if(newsize == oldsize) return NOTHREAD;
+
+		thread_slot* table = (thread_slot*) realloc(pcb->thread_table, newsize*sizeof(thread_slot));
+		if(table == NULL) FATAL("virtual memory exhausted");
+
+		for(uint i = oldsize; i < newsize; i++) {
+			table[i].ptcb = NULL;
+			table[i].gen = 0;
+			table[i].next_free = (i+1 < newsize) ? (int)(i+1) : -1;
+		}
+		pcb->thread_table = table;
+		pcb->thread_table_size = newsize;
+		pcb->thread_table_free = oldsize;
+	}
+
+	int i = pcb->thread_table_free;
+	thread_slot* slot = & pcb->thread_table[i];
+	pcb->thread_table_free = slot->next_free;
+	slot->ptcb = ptcb;
+
+	return (slot->gen << TID_INDEX_BITS) | (Tid_t)(i+1);
 }
 
-void* allocate_PTCB(size_t size)
+/* Return the PTCB of a thread id, or NULL if it is not valid for the process */
+static PTCB* thread_table_lookup(PCB* pcb, Tid_t tid)
 {
-  void* ptr = mmap(NULL, size,
-      PROT_READ|PROT_WRITE|PROT_EXEC,
-      MAP_ANONYMOUS  | MAP_PRIVATE
-      , -1,0);
-
-  CHECK((ptr==MAP_FAILED)?-1:0);
-
-  return ptr;
+	Tid_t i = tid & TID_INDEX_MASK;
+	if(i == 0 || i > pcb->thread_table_size) 
+		return NULL;
+
+	thread_slot* slot = & pcb->thread_table[i-1];
+	if(slot->ptcb == NULL || slot->gen != (tid >> TID_INDEX_BITS))
+		return NULL;
+	return slot->ptcb;
 }
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
-  be made easily to 'detect' stack overflow.
- */
-void free_PTCB(void* ptr, size_t size)
+
+void release_PTCB(PTCB* ptcb)
 {
-	free(ptr);
+	/* Free the slot, with a new generation */
+	PCB* pcb = ptcb->owner_pcb;
+	int i = (int)(ptcb->tid & TID_INDEX_MASK) - 1;
+	thread_slot* slot = & pcb->thread_table[i];
+	assert(slot->ptcb == ptcb);
+
+	slot->ptcb = NULL;
+	slot->gen = (slot->gen + 1) & TID_GEN_MASK;
+	slot->next_free = pcb->thread_table_free;
+	pcb->thread_table_free = i;
+
+	slab_free(&ptcb_cache, ptcb);
 }
 
-void* allocate_PTCB(size_t size)
+void release_all_PTCBs(PCB* pcb)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr==NULL)?-1:0);
-	return ptr;
+	while(! is_rlist_empty(& pcb->ptcb_list)) {
+		rlnode* tmp = rlist_pop_front(& pcb->ptcb_list);
+		release_PTCB(tmp->ptcb);
+	}
+
+	free(pcb->thread_table);
+	pcb->thread_table = NULL;
+	pcb->thread_table_size = 0;
+	pcb->thread_table_free = -1;
 }
-#endif
 
 
 Tid_t get_tid(TCB* tcb)
@@ -82,12 +131,33 @@ void start_thread()
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+	return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
+{
+	/* Round up to pages, within the limits */
+	size_t ssize = (stack_size == 0) ? THREAD_STACK_SIZE : stack_size;
+	if(ssize > THREAD_STACK_MAX) 
+		return NOTHREAD;
+	if(ssize < THREAD_STACK_MIN) 
+		ssize = THREAD_STACK_MIN;
+	ssize = (ssize + SYSTEM_PAGE_SIZE - 1) & ~((size_t)SYSTEM_PAGE_SIZE - 1);
+
 //	VDK Edit
 	/* Inherit parent */
 	PCB * curproc = CURPROC;
 
-	/* Create New PTCB. The allocated TCB size must be a multiple of page size*/
-	PTCB* ptcb = (PTCB*) allocate_PTCB(THREAD_PTCB_SIZE);
+	/* Create New PTCB, and give it a thread id */
+	PTCB* ptcb = (PTCB*) slab_alloc(&ptcb_cache);
+	ptcb->tid = thread_table_insert(curproc, ptcb);
+	if(ptcb->tid == NOTHREAD) {
+		slab_free(&ptcb_cache, ptcb);
+		return NOTHREAD;
+	}
 
     /*Init*/
     ptcb->owner_pcb = curproc;
@@ -103,12 +173,10 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
     rlnode_init(& ptcb->node, ptcb);  /* Intrusive list node */
     rlist_push_back(& curproc->ptcb_list, & ptcb->node);
 
-    ptcb->tid = (Tid_t) ptcb; //Get TID of thread
-
     //we test the unlike scenario that task != NULL
     if(task != NULL){
       CURPROC->ptcb_counter++;
-      ptcb->thread = spawn_thread(curproc, start_thread);
+      ptcb->thread = spawn_thread(curproc, start_thread, ssize);
       ptcb->thread->owner_ptcb = ptcb;
       wakeup(ptcb->thread); //Wake up the thread
     }
@@ -123,8 +191,9 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 Tid_t sys_ThreadSelf()
 {
   /**We defined and used Tid inside ptcb. So we also needed to change ThreadSelf.
-  In order to find Tid we must return its pointer to ptcb from tcb */
-  return (Tid_t)(CURTHREAD->owner_ptcb);
+  In order to find Tid we must go to the ptcb from the tcb */
+  PTCB* ptcb = CURTHREAD->owner_ptcb;
+  return (ptcb == NULL) ? NOTHREAD : ptcb->tid;
 }
 
 /**
@@ -132,47 +201,53 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
-  //Find ptcb from the tid
-  PTCB* ptcb = (PTCB*)tid;
-
-  //Check list if there is valid tid
-  if(rlist_find(&CURPROC->ptcb_list,ptcb, NULL)!=NULL){
-
-    /**Now we need to check for all the cases
-        1.Check for exited status
-        2.Check for detached status
-        3.Check that it is not itself
-    */
-    if( tid == sys_ThreadSelf() || ptcb->isDetached ){
-      //case the procedure is unsuccessful return -1
-      return -1;
-
-    }else{
-      //When enters jointhread increase refCount
-      ptcb->refCount++;
-
-      //Join work is the thread of the given TID is not exited and detached
-      while(ptcb->isExited == 0 && ptcb->isDetached == 0){
-        kernel_wait(&ptcb->cVar, SCHED_USER);
-      }
+  //Find ptcb from the tid, in the thread table
+  PTCB* ptcb = thread_table_lookup(CURPROC, tid);
 
-      //When kernel wait finishes thread is at detached or exited state and we reduce refCount to kill it afterwards
-      ptcb->refCount--;
+  //There is no such thread (or it was already joined)
+  if(ptcb == NULL)
+    return -1;
 
-      //We need to check that exitval has different value from NULL(NOPROC)
-      if(exitval!=NULL){
-        *exitval = ptcb -> exitval;
-      }
+  /**Now we need to check for all the cases
+      1.Check for detached status
+      2.Check that it is not itself
+  */
+  if( tid == sys_ThreadSelf() || ptcb->isDetached )
+    return -1;
 
-      //Already exited
-      if (ptcb->refCount <= 0)
-      {
-        rlist_remove(&ptcb->node);
-        free(ptcb);
-      }
+  //When enters jointhread increase refCount
+  ptcb->refCount++;
+
+  //Join work is the thread of the given TID is not exited and detached
+  while(ptcb->isExited == 0 && ptcb->isDetached == 0){
+    kernel_wait(&ptcb->cVar, SCHED_USER);
+  }
+
+  //When kernel wait finishes thread is at detached or exited state and we reduce refCount to kill it afterwards
+  ptcb->refCount--;
+
+  //The thread was detached while we waited: this is an error. 
+  //A detached thread is released by ThreadExit, or by the last joiner to leave after it exited
+  if(ptcb->isDetached){
+    if(ptcb->isExited && ptcb->refCount <= 0){
+      rlist_remove(&ptcb->node);
+      release_PTCB(ptcb);
     }
-    
+    return -1;
   }
+
+  //We need to check that exitval has different value from NULL(NOPROC)
+  if(exitval!=NULL){
+    *exitval = ptcb -> exitval;
+  }
+
+  //The last joiner releases the exited thread, so its tid is no longer valid
+  if (ptcb->refCount <= 0)
+  {
+    rlist_remove(&ptcb->node);
+    release_PTCB(ptcb);
+  }
+
   //case the procedure is successful return 0
   return 0;
 }
@@ -183,11 +258,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 int sys_ThreadDetach(Tid_t tid)
 {
   //Find ptcb from the tid
-  PTCB* ptcb = (PTCB*)tid;
+  PTCB* ptcb = thread_table_lookup(CURPROC, tid);
 
   /**We must initially check that given Tid belongs to CURPROC
-  so we scan the entire rlnode list. We must also check that thread is not exited*/
-  if(rlist_find(& CURPROC->ptcb_list, ptcb, NULL) != NULL && !ptcb->isExited){
+  so we look it up in the thread table. We must also check that thread is not exited*/
+  if(ptcb != NULL && !ptcb->isExited){
 
     ptcb->isDetached = 1; //Change detach flag state to 1(true)
     kernel_broadcast(& ptcb->cVar); //Broadcast cVar of ptcb
@@ -210,23 +285,20 @@ void sys_ThreadExit(int exitval)
 
     kernel_broadcast(&cur_ptcb->cVar);  //Broadcast all the threads that are sleeping in this thread's cVar
 
-    //There is a case where the thread will not attempt to join so we must free it afterwards
-    if (cur_ptcb->refCount <= 0)
+    //A detached thread will not be joined, so we must free it now.
+    //An undetached one is kept until it is joined, or until the process cleans up its threads
+    if (cur_ptcb->isDetached && cur_ptcb->refCount <= 0)
       {
         rlist_remove(&cur_ptcb->node);
-        free(cur_ptcb);
+        release_PTCB(cur_ptcb);
       }
 
     //Decrease thread number
     CURPROC->ptcb_counter--;
 
     //In case we find the last ptcb clean up everything
-    if(CURPROC->ptcb_counter == 0){
-      while(! is_rlist_empty(& (CURPROC->ptcb_list))){
-        rlnode* tmp = rlist_pop_front(&(CURPROC->ptcb_list));
-        free(tmp->ptcb);
-      }
-    }
+    if(CURPROC->ptcb_counter == 0)
+      release_all_PTCBs(CURPROC);
 
     kernel_sleep(EXITED, SCHED_USER); //Kill the thread
 
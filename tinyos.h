@@ -49,11 +49,15 @@ typedef int Fid_t;
 
 /** @brief The maximum number of open files per process. 
    Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
-#define MAX_FILEID 16
+#define MAX_FILEID 4096
 
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
+/** @brief Returned by I/O calls on a non-blocking stream, when they would block. 
+  @see CTL_SET_NONBLOCK */
+#define WOULDBLOCK  (-2)
+
 
 /**
   @brief The type of a thread ID.
@@ -321,6 +325,29 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+
+/** 
+  @brief Create a new thread with a given stack size.
+
+  This call is like @c CreateThread, but the new thread runs on a 
+  stack of @c stack_size bytes, instead of the default size (128 kbytes).
+  Small stacks allow many more threads in the same memory, while 
+  deeply recursive tasks can get a larger stack. The size is rounded 
+  up to a multiple of the page size, and to at least 16 kbytes.
+
+  A thread which overflows its stack is stopped by a memory fault, 
+  before it corrupts other kernel data.
+
+  @param task a function to execute
+  @param argl the first argument of @c task
+  @param args the second argument of @c task
+  @param stack_size the stack size in bytes, or 0 for the default size
+  @returns the new thread id, or @c NOTHREAD if @c stack_size is 
+     larger than 64 Mbytes.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -433,6 +460,7 @@ Fid_t OpenNull();
         Possible errors are:
          - The file descriptor is invalid.
          - There was a I/O runtime problem.
+        If the stream is non-blocking and there is no data, @c WOULDBLOCK is returned.
  */
 int Read(Fid_t fd, char *buf, unsigned int size);
 
@@ -456,6 +484,8 @@ int Read(Fid_t fd, char *buf, unsigned int size);
    Possible errors are:
    - The file id is invalid.
    - There was a I/O runtime problem.
+   If the stream is non-blocking, @c Write copies only what fits without 
+   waiting, and returns @c WOULDBLOCK if nothing fits.
  */
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
@@ -491,6 +521,193 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Commands for @c StreamControl. */
+typedef enum stream_control_e {
+  CTL_GET_PIPE_SIZE,    /**< Return the capacity of a pipe, in bytes */
+  CTL_SET_PIPE_SIZE,    /**< Set the capacity of a pipe, in bytes, returning the new capacity */
+  CTL_GET_NONBLOCK,     /**< Return 1 if the file id is non-blocking, else 0 */
+  CTL_SET_NONBLOCK,     /**< Make the file id non-blocking (@c arg!=0) or blocking (@c arg==0) */
+  CTL_GET_REUSEPORT,    /**< Return 1 if a socket may share its port with other listeners, else 0 */
+  CTL_SET_REUSEPORT,    /**< Let an unbound socket share its port with other listeners (@c arg!=0) or not */
+  CTL_GET_BACKLOG,      /**< Return the maximum number of pending connections of a socket, or 0 for no limit */
+  CTL_SET_BACKLOG,      /**< Set the maximum number of pending connections of a socket to @c arg (0 for no limit) */
+  CTL_GET_MESSAGE_MODE, /**< Return 1 if a socket carries messages instead of bytes, else 0 */
+  CTL_SET_MESSAGE_MODE  /**< Make an unbound socket carry messages (@c arg!=0) or bytes (@c arg==0) */
+} stream_control;
+
+
+/** @brief Get or set a property of a stream.
+
+  This call is used to control properties of streams which are not
+  covered by other calls. The meaning of @c arg and of the return value
+  depend on the command:
+
+  - @c CTL_GET_PIPE_SIZE returns the capacity of a pipe (either end), or of 
+    the receiving direction of a connected socket. @c arg is ignored.
+  - @c CTL_SET_PIPE_SIZE sets this capacity to @c arg bytes, rounded up to a 
+    power of 2 between @c PIPE_PAGE_SIZE and @c PIPE_MAX_SIZE, and returns
+    the new capacity. It fails if the pipe holds more data than the new 
+    capacity.
+
+  - @c CTL_GET_NONBLOCK and @c CTL_SET_NONBLOCK get and set the non-blocking
+    mode of any file id. The mode belongs to the open stream, so it is shared
+    by the file ids copied with @c Dup2. On a non-blocking stream, @c Read, 
+    @c Write, their vectored forms, @c Splice and @c Accept return 
+    @c WOULDBLOCK instead of waiting. Use @c Poll to wait for readiness.
+
+  - @c CTL_GET_REUSEPORT and @c CTL_SET_REUSEPORT get and set the flag of a
+    socket that allows it to listen on a port together with other sockets.
+    The flag can only be set before @c Listen. If all the listeners on a 
+    port have it, then new connections are distributed among them.
+
+  - @c CTL_GET_BACKLOG and @c CTL_SET_BACKLOG get and set the backlog of
+    a socket, that is, the maximum number of connections that may be pending
+    at it as a listener. A @c Connect that finds no listener with room fails
+    at once, instead of waiting for its timeout. The backlog can be set 
+    before or after @c Listen; it is @c DEFAULT_BACKLOG for a new socket.
+    Since every pending connection holds kernel memory, a backlog of 0 
+    (no limit) should only be set when the listener keeps up with @c Accept.
+
+  - @c CTL_GET_MESSAGE_MODE and @c CTL_SET_MESSAGE_MODE get and set the 
+    message mode of a socket. The mode can only be set before @c Listen 
+    or @c Connect, and a socket can only connect to listeners of the same
+    mode; the sockets returned by @c Accept have the mode of the listener.
+    A connection in message mode keeps the boundaries of the data: each
+    @c Write (or @c WriteV) of @c n>0 bytes sends one message, and each 
+    @c Read (or @c ReadV) receives one whole message, dropping the bytes 
+    that do not fit in the buffer. A @c Write of 0 bytes sends nothing. A 
+    message must fit in the pipe size of the connection, else @c Write
+    fails. @c Splice fails between such a socket and a pipe or a socket.
+    When a message does not fit in the free room (and a non-blocking 
+    @c Write returns @c WOULDBLOCK), @c Poll reports @c POLL_WRITE again 
+    only when there is room for a message of that size.
+
+  The memory of a pipe buffer is allocated on demand, starting with one page 
+  and doubling up to the capacity. When the pipe is drained, a buffer that 
+  was at most half full since the previous drain shrinks to one page. This 
+  page is returned when a reader waits for data on the empty pipe (in 
+  @c Read, @c Splice or @c Poll), so an idle pipe keeps no buffer, unless 
+  its last transfers needed more than a page.
+
+  @param fd the file id of the stream
+  @param cmd the command
+  @param arg the argument of the command
+  @returns a non-negative value on success, or -1 on failure. Possible
+    reasons for failure:
+    - the file id is invalid
+    - the stream does not support the command
+    - the argument is illegal for the command
+ */
+int StreamControl(Fid_t fd, stream_control cmd, int arg);
+
+
+/** @brief Move data from one stream to another.
+
+  Read up to @c size bytes from stream @c in and write them to stream @c out,
+  without copying them to user space. When both streams are backed by pipes
+  (pipe ends or connected sockets), the data moves directly from one pipe 
+  buffer to the other. Otherwise, it is copied through a kernel buffer.
+
+  Like @c Read, this call blocks until some data is available, and may
+  move fewer than @c size bytes. 
+
+  When the data is copied through a kernel buffer and writing to @c out
+  fails part way, the bytes already read from @c in but not accepted by
+  @c out are lost. The return value counts only the bytes written to @c out.
+
+  @param in the file id to read from
+  @param out the file id to write to
+  @param size the maximum number of bytes to move
+  @returns the number of bytes moved, 0 if @c in has reached end of data, or -1
+    on error. Possible reasons for error:
+    - either file id is invalid
+    - @c in cannot be read or @c out cannot be written
+    - @c in and @c out refer to the same pipe
+ */
+int Splice(Fid_t in, Fid_t out, unsigned int size);
+
+
+/** @brief Poll event: @c Read (or @c Accept) will not block */
+#define POLL_READ    1
+/** @brief Poll event: @c Write will not block, there is room for some data */
+#define POLL_WRITE   2
+/** @brief Poll event: the other end of the stream is closed (always reported) */
+#define POLL_HANGUP  4
+/** @brief Poll event: the file id is not open (always reported) */
+#define POLL_INVALID 8
+
+/** @brief An entry for @c Poll. */
+typedef struct pollfd_s {
+  Fid_t fd;         /**< The file id to poll, or @c NOFILE to skip the entry */
+  int events;       /**< The requested events (@c POLL_READ, @c POLL_WRITE) */
+  int revents;      /**< The returned events */
+} pollfd_t;
+
+
+/** @brief Wait for some streams to become ready.
+
+  This call waits until at least one of the @c nfds file ids in @c fds
+  is ready for one of its requested @c events, or the timeout expires.
+  On return, the @c revents field of each entry holds the events
+  that are ready for it. A stream which does not support polling 
+  (e.g., the null device) is always ready.
+
+  A listening socket is ready for @c POLL_READ when @c Accept would not block.
+  A socket which is not connected yet becomes ready when it is connected.
+
+  @param fds the array of entries
+  @param nfds the number of entries in @c fds
+  @param timeout the time to wait in milliseconds, 0 to return immediately,
+     or @c (timeout_t)-1 to wait for ever
+  @returns the number of entries with non-zero @c revents, 0 if the timeout
+     expired, or -1 on error.
+ */
+int Poll(pollfd_t* fds, unsigned int nfds, timeout_t timeout);
+
+
+/** @brief A buffer for vectored I/O.
+
+  @see ReadV
+  @see WriteV
+ */
+typedef struct iovec_s {
+  void* base;           /**< The start of the buffer */
+  unsigned int len;     /**< The size of the buffer */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into many buffers.
+
+  This call is like @c Read, except that the data is placed into
+  the @c iovcnt buffers of @c iov, in order, filling each buffer before 
+  moving to the next. 
+
+  @param fd  the file ID of the stream to read from
+  @param iov the array of buffers
+  @param iovcnt the number of buffers in @c iov
+  @return the total number of bytes copied, 0 if we have reached EOF, or -1, 
+    indicating some error.
+  @see Read
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from many buffers.
+
+  This call is like @c Write, except that the data is taken from
+  the @c iovcnt buffers of @c iov, in order. For a pipe or a socket,
+  this costs one system call and wakes up the reader at most once, as 
+  long as the data fits in the pipe.
+
+  @param fd  the file ID of the stream to write to
+  @param iov the array of buffers
+  @param iovcnt the number of buffers in @c iov
+  @return the total number of bytes written, or -1, indicating some error.
+  @see Write
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
 /*******************************************
  *
  * Pipes
@@ -539,21 +756,36 @@ int pipe_read(void* this, char *buf, unsigned int size);
 
 int pipe_write(void* this, const char* buf, unsigned int size);
 
+int pipe_readv(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+int pipe_writev(void* this, const iovec_t* iov, unsigned int iovcnt);
+
 int pipe_writer_close(void* this);
 
 int pipe_reader_close(void* this);
 
+int pipe_control(void* this, stream_control cmd, int arg);
+
 
-#define BUFFER_SIZE 8192 /* As adviced in class*/
+#define BUFFER_SIZE 8192 /* As adviced in class. The default capacity of a pipe*/
+#define PIPE_PAGE_SIZE 4096 /* The smallest pipe buffer */
+#define PIPE_MAX_SIZE (1<<20) /* The largest pipe capacity */
 
 /*****************************PIPE CONTROL BLOCK******************************/
 
+typedef struct Pipe_Control_Block PIPCB;
+
 typedef struct Pipe_Control_Block
 {
-  char buffer[BUFFER_SIZE]; /** Our buffer*/
+  char* buffer; /** Our buffer, allocated on demand (NULL while empty)*/
+  unsigned int bufsize;  /** The size of buffer, a power of 2 (0 if not allocated)*/
+  unsigned int capacity; /** The largest size of buffer, a power of 2*/
 
-  int readerPos;  //We need to keep variables about reader and writer position
-  int writerPos;
+  /**Split indices: they only grow (wrapping around as unsigned), and the
+  buffer holds writerPos-readerPos bytes, starting at readerPos % bufsize*/
+  unsigned int readerPos;
+  unsigned int writerPos;
+  unsigned int peak;  /** The most bytes in the buffer since it was last drained*/
 
   FCB *readerFCB, *writerFCB; /**TODO ask where they are used*/
 
@@ -567,13 +799,32 @@ typedef struct Pipe_Control_Block
   int readerClosedFlag;
   int writerClosedFlag; /**MUST KNOW IF READER/WRITER IS CLOSED*/
 
-  int elementcounter; /**We should count the elements of the buffer so that we know if 
-              the buffer is empty or full */
+  Mutex spinlock; /**The lock of a pipe made by Pipe()*/
+  Mutex* lock;    /**Protects the pipe, since Read and Write run without the kernel lock. 
+                     It is either spinlock, or the lock of a socket connection, 
+                     shared by its two directions*/
+  void (*release)(PIPCB*); /**Frees the pipe control block, once both ends are closed,
+                              or NULL if it is freed with the object that contains it*/
+
+  rlnode pollers; /**The Poll calls waiting for this pipe*/
+
+  int message;     /**Set if the pipe carries messages instead of bytes (see kernel_pipe.c)*/
+  rlnode messages; /**The queued messages, in message mode*/
+  unsigned int blocked; /**The size of the last message that did not fit, or 0 (see pipe_writer_poll)*/
 }PIPCB;
 
 
 PIPCB* pipe_Init(FCB** fcb);
 
+void pipe_init(PIPCB* pipcb, FCB* reader, FCB* writer, Mutex* lock, void (*release)(PIPCB*));
+
+struct poll_waiter;
+int pipe_reader_poll(void* this, int events, struct poll_waiter* w);
+
+int pipe_writer_poll(void* this, int events, struct poll_waiter* w);
+
+int pipe_splice(PIPCB* from, PIPCB* to, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -592,6 +843,11 @@ typedef int16_t port_t;
 */
 #define MAX_PORT 1023
 
+/**
+	@brief the backlog of a new socket (see @c CTL_SET_BACKLOG)
+*/
+#define DEFAULT_BACKLOG 128
+
 /**
 	@brief a null value for a port
 */
@@ -599,13 +855,6 @@ typedef int16_t port_t;
 
 typedef struct socket_control_block SCB;
 
-//Function that initializes the port table to NULL
-static inline void initialize_port_map(SCB* port_map[]){
-  for(int i=0; i<= MAX_PORT+1; i++){
-    port_map[i] = NULL;
-  }
-}
-
 
 typedef enum {
     UNBOUND,
@@ -615,16 +864,39 @@ typedef enum {
 
 
 typedef struct listen_socket {
-  //the queue that stores the requests for p2p connection
+  //the queue of the connected PEER sockets that wait for Accept
   rlnode requestQueue; 
   // condition var to check if the queue is empty
   CondVar cv_request;  
+  // the number of sockets in the queue
+  unsigned int nrequests;
+  // node in the list of the listeners of the port
+  rlnode port_node;
 } listener_socket;
 
 
+/*
+  The connection of two PEER sockets: the pipes of its two directions,
+  allocated together and protected by one lock. It is freed when both
+  sockets are closed.
+ */
+typedef struct socket_connection {
+  // protects both pipes
+  Mutex spinlock;
+  // the PEER sockets that are not closed yet
+  int ref_counter;
+  // pipe[i] carries the data written by the socket at side i
+  PIPCB pipe[2];
+} socket_conn;
+
+
 typedef struct pr_socket {
   // pointer to peer socket to connect to 
   SCB* socket_pointer;
+  // the connection that holds the two pipes
+  socket_conn* conn;
+  // node in the queue of the LISTENER, while the socket waits for Accept
+  rlnode accept_node;
   // pipe that receives data
   PIPCB* pipe_receiver;
   // pipe that sends data
@@ -636,12 +908,23 @@ typedef struct pr_socket {
 typedef struct socket_control_block {
   // how many sockets observe this socket
   int ref_counter; 
+  // protects sock_type and peer_sock against Read/Write, which run without the kernel lock,
+  // and the request queue and pollers against Poll
+  Mutex spinlock;
+  // the Poll calls waiting for this socket (as a listener, or to become a peer)
+  rlnode pollers;
   FCB* fcb;
   Fid_t fid;
   //the port to listen at
   uint port;
   //3 types of sockets(enum)
   socket_type sock_type;
+  //set if the socket may listen on a port together with other sockets
+  int reuseport;
+  //set if the socket carries messages instead of bytes
+  int message;
+  //the maximum number of requests queued at the socket as a LISTENER, 0 for no limit
+  unsigned int backlog;
 
   union {
     peer_socket peer_sock; 
@@ -651,19 +934,8 @@ typedef struct socket_control_block {
 
 
 
-typedef struct request_queue{
-  SCB* scb;
-  CondVar cv;
-  //(0,1): 1 if connection was successfull
-  int request_flag;
-  //the queue that stores the requests
-  rlnode req_queue;
-} queue_request;
 
 
-//Table with the ports
-SCB* PORT_MAP[MAX_PORT+1];
-
 
 /**
 	@brief Return a new socket bound on a port.
@@ -691,13 +963,21 @@ Fid_t Socket(port_t port);
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless all the listening sockets
+	of the port have been set with @c CTL_SET_REUSEPORT (see @c StreamControl). 
+	Then, each @c Connect to the port is queued at the listener with the fewest 
+	pending connections, taking turns among equals. When such a listener is 
+	closed, its pending connections move to the other listeners of the port.
+	The number of pending connections of a listener can be limited with
+	@c CTL_SET_BACKLOG.
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
 		- the file id is not legal
 		- the socket is not bound to a port
-		- the port bound to the socket is occupied by another listener
+		- the port bound to the socket is occupied by another listener, and
+		  either socket is not set with @c CTL_SET_REUSEPORT, or they have 
+		  different message modes
 		- the socket has already been initialized
 	@see Socket
  */
@@ -709,7 +989,8 @@ int Listen(Fid_t sock);
 
 	With a listening socket as its sole argument, this call will block waiting
 	for a single @c Connect() request on the socket's port. 
-	one which can be passed as an argument to @c Accept. 
+	one which can be passed as an argument to @c Accept. A connection made by 
+	@c Connect waits at the listening socket until it is accepted.
 
 	It is possible (and desirable) to re-use the listening socket in multiple successive
 	calls to Accept. This is a typical pattern: a thread blocks at Accept in a tight
@@ -723,6 +1004,8 @@ int Listen(Fid_t sock);
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
 		- while waiting, the listening socket @c lsock was closed
+	    If @c lsock is non-blocking and there is no pending connection, 
+	    @c WOULDBLOCK is returned.
 
 	@see Connect
 	@see Listen
@@ -730,6 +1013,30 @@ int Listen(Fid_t sock);
 Fid_t Accept(Fid_t lsock);
 
 
+/**
+	@brief Wait for a number of connections.
+
+	This call works like @c Accept, but it accepts at once as many of the
+	pending connections of @c lsock as possible, up to @c n. It blocks only 
+	while there is no pending connection at all. Accepting a burst of 
+	connections this way is cheaper than calling @c Accept once for each.
+
+	@param lsock the listening socket
+	@param fids an array of at least @c n file ids, where the file ids of the
+	    new sockets are stored
+	@param n the maximum number of connections to accept
+	@returns the number of connections accepted (at least 1), or @c NOFILE on 
+	    error. The possible errors are those of @c Accept, and also @c n being 0.
+	    Fewer than the pending connections may be accepted, if the available
+	    file ids are not enough for all of them.
+	    If @c lsock is non-blocking and there is no pending connection, 
+	    @c WOULDBLOCK is returned.
+
+	@see Accept
+ */
+int AcceptMany(Fid_t lsock, Fid_t* fids, unsigned int n);
+
+
 
 /**
 	@brief Create a connection to a listener at a specific port.
@@ -741,20 +1048,23 @@ Fid_t Accept(Fid_t lsock);
 	The two connected sockets communicate by virtue of two pipes of opposite directions, 
 	but with one file descriptor servicing both pipes at each end.
 
-	The connect call will block for approximately the specified amount of time.
-	The resolution of this timeout is implementation specific, but should be
-	in the order of 100's of msec. Therefore, a timeout of at least 500 msec is
-	reasonable. If a negative timeout is given, it means, "infinite timeout".
+	The connection is established at once, without waiting for the listener
+	to call @c Accept: the new stream waits in the queue of the listening socket,
+	until @c Accept returns it, and @c sock can send data right away. If the 
+	listening socket is closed before accepting it, @c sock sees the end of data.
 
 	@params sock the socket to connect to the other end
 	@params port the port on which to seek a listening socket
-	@params timeout the approximate amount of time to wait for a
-	        connection.
+	@params timeout the approximate amount of time to wait for a connection.
+	        Since a connection never waits for @c Accept, it is not used.
 	@returns 0 on success and -1 on error. Possible reasons for error:
 	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
-	   - the timeout has expired without a successful connection.
+	   - the listening sockets of the port have a different message mode
+	     (see @c CTL_SET_MESSAGE_MODE).
+	   - the listening sockets of the port already have as many pending 
+	     connections as their backlog (see @c CTL_SET_BACKLOG).
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
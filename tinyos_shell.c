@@ -720,17 +720,16 @@ finish:
    the client program
 ************************/
 
-/* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
+/* helper for RemoteClient: send a message made of many buffers, with one call */
+static void send_message(Fid_t sock, const iovec_t* iov, unsigned int iovcnt)
 {
-	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or End of stream */
-		count += rc;
-	}
-	if(count!=len) {
-		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
+	size_t len = 0;
+	for(unsigned int i=0; i<iovcnt; i++)
+		len += iov[i].len;
+
+	int rc = WriteV(sock, iov, iovcnt);
+	if(rc<0 || (size_t)rc!=len) {
+		printf("In client: I/O error writing %zu bytes (%d written)\n", len, rc);
 		Exit(1);
 	}
 }
@@ -754,9 +753,12 @@ int RemoteClient(size_t argc, const char** argv)
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
-	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	/* Send message: the header and the payload */
+	iovec_t msg[2] = {
+		{ .base = &argl, .len = sizeof(argl) },
+		{ .base = args, .len = argl }
+	};
+	send_message(sock, msg, 2);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
 	/* Read the server data and display */
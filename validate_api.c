@@ -214,6 +214,34 @@ BOOT_TEST(test_exec_copies_arguments,
 }
 
 
+BOOT_TEST(test_many_processes,
+	"Test that many processes can exist at the same time, beyond the first "
+	"chunk of the process table."
+	)
+{
+	int child(int argl, void* args) {
+		return GetPid();
+	}
+
+#define NPROCS 1000
+	static Pid_t pids[NPROCS];
+	for(int i=0; i<NPROCS; i++) {
+		pids[i] = Exec(child, 0, NULL);
+		ASSERT(pids[i]!=NOPROC);
+	}
+
+	/* The children are zombies now, and keep their pids */
+	for(int i=NPROCS; i>0; i--) {
+		int status;
+		ASSERT(WaitChild(pids[i-1], &status)==pids[i-1]);
+		ASSERT(status==pids[i-1]);
+	}
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+#undef NPROCS
+	return 0;
+}
+
+
 BOOT_TEST(test_wait_for_any_child, 
 	"Test WaitChild when called to wait on any child."
 	)
@@ -553,6 +581,24 @@ BOOT_TEST(test_close_success_on_valid_nonfile_fid,
 	return 0;
 }
 
+BOOT_TEST(test_lowest_fid_is_used,
+	"Test that new files get the lowest free fid, as the table of fids grows."
+	)
+{
+	for(Fid_t i=0; i<MAX_FILEID; i++)
+		ASSERT(OpenNull()==i);
+	ASSERT(OpenNull()==NOFILE);
+
+	ASSERT(Close(MAX_FILEID-1)==0);
+	ASSERT(Close(MAX_FILEID/2+3)==0);
+	ASSERT(Close(3)==0);
+	ASSERT(OpenNull()==3);
+	ASSERT(OpenNull()==MAX_FILEID/2+3);
+	ASSERT(OpenNull()==MAX_FILEID-1);
+	ASSERT(OpenNull()==NOFILE);
+	return 0;
+}
+
 BOOT_TEST(test_close_terminals,
 	"Test that terminals can be opened and then closed without error."
 	)
@@ -728,6 +774,43 @@ BOOT_TEST(test_child_inherits_files,
 
 
 
+BOOT_TEST(test_child_files_are_private,
+	"Test that closing and duplicating files in a child does not change the files "
+	"of the parent, and vice versa."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	int child(int argl, void* args)
+	{
+		pipe_t p = *(pipe_t*) args;
+		char buf[4];
+		ASSERT(Close(p.read)==0);
+		ASSERT(Read(p.read, buf, 4)==-1);
+		ASSERT(Dup2(p.write, p.read)==0);
+		ASSERT(Write(p.read, "hello", 5)==5);
+		return 0;
+	}
+
+	Pid_t cpid = Exec(child, sizeof(p), &p);
+	ASSERT(cpid!=NOPROC);
+
+	/* This does not change the files of the child */
+	Fid_t fid = p.write+1;
+	ASSERT(Dup2(p.write, fid)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+
+	char buf[8];
+	ASSERT(Close(fid)==0);
+	ASSERT(Read(p.read, buf, 8)==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(Read(p.read, buf, 8)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_null_device,
 	"Test the null device."
 	)
@@ -879,6 +962,7 @@ TEST_SUITE(basic_tests,
 	&test_exit_returns_status,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
+	&test_many_processes,
 	&test_orphans_adopted_by_init,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
@@ -891,6 +975,7 @@ TEST_SUITE(basic_tests,
 	&test_dup2_copies_file,
 	&test_close_error_on_invalid_fid,
 	&test_close_success_on_valid_nonfile_fid,
+	&test_lowest_fid_is_used,
 	&test_close_terminals,
 	&test_read_kbd,
 	&test_read_kbd_big,
@@ -901,6 +986,7 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_child_files_are_private,
 	NULL
 };
 
@@ -970,12 +1056,166 @@ BOOT_TEST(test_exit_many_threads,
 
 
 
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads can be created with small and large stacks, and that "
+	"illegal stack sizes are rejected."
+	)
+{
+	/* Use about 'argl' bytes of stack, in frames of 1 KiB, and return the 
+	   number of frames, or -1 if a frame was overwritten by a deeper one */
+	int deep(int argl, void* args) {
+		volatile char frame[1024];
+		char mark = (char) (argl >> 10);
+		frame[0] = frame[1023] = mark;
+		int below = (argl > 1024) ? deep(argl-1024, args) : 0;
+		if(below < 0 || frame[0] != mark || frame[1023] != mark) return -1;
+		return below + 1;
+	}
+
+	Tid_t t;
+	int exitval;
+
+	t = CreateThreadStack(deep, 4096, NULL, 16*1024);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 4);
+
+	/* This does not fit in the default stack */
+	t = CreateThreadStack(deep, 1<<20, NULL, 2<<20);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 1024);
+
+	/* Small sizes are rounded up */
+	t = CreateThreadStack(deep, 0, NULL, 1);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==1);
+
+	ASSERT(CreateThreadStack(deep, 0, NULL, 128<<20)==NOTHREAD);
+	return 0;
+}
+
+
+BOOT_TEST(test_stale_tid,
+	"Test that the id of a thread that was joined does not refer to the thread "
+	"created after it, and that bad thread ids are rejected."
+	)
+{
+	static Tid_t self;
+	int task(int argl, void* args) {
+		self = ThreadSelf();
+		return argl;
+	}
+
+	int exitval;
+	Tid_t t1 = CreateThread(task, 1, NULL);
+	ASSERT(t1!=NOTHREAD);
+	ASSERT(ThreadJoin(t1, &exitval)==0);
+	ASSERT(exitval==1);
+	ASSERT(self==t1);
+
+	/* This thread probably reuses the PTCB and the slot of t1 */
+	Tid_t t2 = CreateThread(task, 2, NULL);
+	ASSERT(t2!=NOTHREAD);
+	ASSERT(t2!=t1);
+	ASSERT(ThreadDetach(t1)==-1);
+	ASSERT(ThreadJoin(t2, &exitval)==0);
+	ASSERT(exitval==2);
+	ASSERT(self==t2);
+
+	ASSERT(ThreadDetach(NOTHREAD)==-1);
+	ASSERT(ThreadDetach((Tid_t) 12345)==-1);
+	ASSERT(ThreadDetach((Tid_t) &exitval)==-1);
+
+	/* A joined thread cannot be joined again, and bad ids are rejected */
+	ASSERT(ThreadJoin(t1, &exitval)==-1);
+	ASSERT(ThreadJoin(t2, &exitval)==-1);
+	ASSERT(ThreadJoin(NOTHREAD, &exitval)==-1);
+	ASSERT(ThreadJoin((Tid_t) 12345, &exitval)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_join_exited_thread,
+	"Test that a thread which exits before it is joined can still be joined, once."
+	)
+{
+	static volatile int done;
+	int task(int argl, void* args) {
+		done = 1;
+		return argl;
+	}
+
+	done = 0;
+	Tid_t t = CreateThread(task, 3, NULL);
+	ASSERT(t!=NOTHREAD);
+
+	/* Let the thread exit first */
+	while(! done);
+	pollfd_t pfd = { .fd = NOFILE, .events = POLL_READ };
+	ASSERT(Poll(&pfd, 1, 50)==0);
+
+	int exitval = 0;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==3);
+	ASSERT(ThreadJoin(t, &exitval)==-1);
+	ASSERT(ThreadDetach(t)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_detach_while_joining,
+	"Test that ThreadJoin fails when the thread is detached while it is being joined, "
+	"and that the detached thread can still run and exit."
+	)
+{
+	static volatile int joining, stop;
+	static Tid_t target;
+	int spinner(int argl, void* args) {
+		while(! stop);
+		return argl;
+	}
+	int joiner(int argl, void* args) {
+		int exitval = 0;
+		joining = 1;
+		int rc = ThreadJoin(target, &exitval);
+		return (rc==-1 && exitval==0) ? 1 : 0;
+	}
+
+	joining = stop = 0;
+	target = CreateThread(spinner, 5, NULL);
+	ASSERT(target!=NOTHREAD);
+	Tid_t j = CreateThread(joiner, 0, NULL);
+	ASSERT(j!=NOTHREAD);
+
+	/* Detach the target while the joiner is (most likely) waiting for it */
+	while(! joining);
+	pollfd_t pfd = { .fd = NOFILE, .events = POLL_READ };
+	ASSERT(Poll(&pfd, 1, 20)==0);
+	ASSERT(ThreadDetach(target)==0);
+
+	int exitval;
+	ASSERT(ThreadJoin(j, &exitval)==0);
+	ASSERT(exitval==1);
+
+	/* The detached thread is still alive, and cannot be joined */
+	ASSERT(ThreadJoin(target, &exitval)==-1);
+	stop = 1;
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
 {
 	&test_create_join_thread,
 	&test_exit_many_threads,
+	&test_create_thread_stack,
+	&test_stale_tid,
+	&test_join_exited_thread,
+	&test_detach_while_joining,
 	NULL
 };
 
@@ -1193,6 +1433,263 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+BOOT_TEST(test_pipe_size_control,
+	"Test that the capacity of a pipe can be changed by StreamControl, and that a pipe fills up to its capacity."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	ASSERT(StreamControl(pipe.read, CTL_GET_PIPE_SIZE, 0)==BUFFER_SIZE);
+	ASSERT(StreamControl(pipe.write, CTL_SET_PIPE_SIZE, 100)==PIPE_PAGE_SIZE);
+	ASSERT(StreamControl(pipe.read, CTL_GET_PIPE_SIZE, 0)==PIPE_PAGE_SIZE);
+	ASSERT(StreamControl(pipe.read, CTL_SET_PIPE_SIZE, 0)==-1);
+	ASSERT(StreamControl(pipe.read, CTL_SET_PIPE_SIZE, PIPE_MAX_SIZE+1)==-1);
+
+	/* A large pipe holds all the data without a reader */
+	ASSERT(StreamControl(pipe.write, CTL_SET_PIPE_SIZE, 3*BUFFER_SIZE)==4*BUFFER_SIZE);
+	static char buffer[4*BUFFER_SIZE];
+	for(int i=0; i<sizeof(buffer); i++) buffer[i] = i % 251;
+	ASSERT(Write(pipe.write, buffer, sizeof(buffer))==sizeof(buffer));
+
+	/* Cannot shrink below the data */
+	ASSERT(StreamControl(pipe.write, CTL_SET_PIPE_SIZE, BUFFER_SIZE)==-1);
+
+	static char rbuffer[4*BUFFER_SIZE];
+	int count = 0;
+	while(count < sizeof(rbuffer)) {
+		int rc = Read(pipe.read, rbuffer+count, sizeof(rbuffer)-count);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(memcmp(buffer, rbuffer, sizeof(buffer))==0);
+
+	/* Not a pipe */
+	Fid_t fnull = OpenNull();
+	ASSERT(StreamControl(fnull, CTL_GET_PIPE_SIZE, 0)==-1);
+	ASSERT(StreamControl(MAX_FILEID, CTL_GET_PIPE_SIZE, 0)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice,
+	"Test that Splice moves data between pipes, and between pipes and other streams."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	char buffer[12] = { [0] = 0 };
+
+	/* From pipe to pipe */
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+	ASSERT(Splice(p1.read, p2.write, 100)==12);
+	ASSERT(Read(p2.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Partial */
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+	ASSERT(Splice(p1.read, p2.write, 6)==6);
+	ASSERT(Splice(p1.read, p2.write, 6)==6);
+	ASSERT(Read(p2.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Wrong directions and same pipe */
+	ASSERT(Splice(p1.write, p2.write, 12)==-1);
+	ASSERT(Splice(p1.read, p2.read, 12)==-1);
+	ASSERT(Splice(p1.read, p1.write, 12)==-1);
+	ASSERT(Splice(p1.read, MAX_FILEID, 12)==-1);
+
+	/* From and to a non-pipe stream */
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull!=NOFILE);
+	ASSERT(Splice(fnull, p2.write, 12)==12);
+	ASSERT(Read(p2.read, buffer, 12)==12);
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+	ASSERT(Splice(p1.read, fnull, 12)==12);
+
+	/* End of data */
+	Close(p1.write);
+	ASSERT(Splice(p1.read, p2.write, 12)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_vectored_io,
+	"Test that WriteV and ReadV gather and scatter data, on pipes and on other streams."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int header = 12;
+	iovec_t wv[3] = {
+		{ .base = &header, .len = sizeof(header) },
+		{ .base = NULL, .len = 0 },
+		{ .base = "Hello world", .len = 12 }
+	};
+	ASSERT(WriteV(pipe.write, wv, 3)==sizeof(header)+12);
+
+	int rheader = 0;
+	char buffer[12] = { [0] = 0 };
+	iovec_t rv[2] = {
+		{ .base = &rheader, .len = sizeof(rheader) },
+		{ .base = buffer, .len = 12 }
+	};
+	ASSERT(ReadV(pipe.read, rv, 2)==sizeof(header)+12);
+	ASSERT(rheader==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Wrong directions */
+	ASSERT(ReadV(pipe.write, rv, 2)==-1);
+	ASSERT(WriteV(pipe.read, wv, 3)==-1);
+
+	/* Streams without vectored I/O */
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull!=NOFILE);
+	ASSERT(WriteV(fnull, wv, 3)==sizeof(header)+12);
+	rheader = 1;
+	ASSERT(ReadV(fnull, rv, 2)==sizeof(header)+12);
+	ASSERT(rheader==0);
+
+	/* Lengths whose sum wraps around are capped, not truncated */
+	static char big[BUFFER_SIZE];
+	iovec_t wrap[2] = {
+		{ .base = big, .len = (unsigned int)-1 },
+		{ .base = buffer, .len = 1 }
+	};
+	ASSERT(ReadV(fnull, wrap, 2)==BUFFER_SIZE);
+
+	Close(pipe.write);
+	ASSERT(ReadV(pipe.read, rv, 2)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_poll,
+	"Test that Poll reports the readiness of pipes, and waits for it."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	pollfd_t pfd[3] = {
+		{ .fd = pipe.read, .events = POLL_READ },
+		{ .fd = pipe.write, .events = POLL_WRITE },
+		{ .fd = NOFILE, .events = POLL_READ }
+	};
+
+	/* The writer is ready, the reader is not */
+	ASSERT(Poll(pfd, 3, 0)==1);
+	ASSERT(pfd[0].revents==0);
+	ASSERT(pfd[1].revents==POLL_WRITE);
+	ASSERT(pfd[2].revents==0);
+
+	/* Time out */
+	ASSERT(Poll(pfd, 1, 10)==0);
+	ASSERT(pfd[0].revents==0);
+
+	/* Wake up on a write by another thread */
+	int writer(int argl, void* args) {
+		fibo(10);
+		ASSERT(Write(pipe.write, "Hello world", 12)==12);
+		return 0;
+	}
+	Tid_t t = CreateThread(writer, 0, NULL);
+	ASSERT(Poll(pfd, 1, (timeout_t)-1)==1);
+	ASSERT(pfd[0].revents==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	char buffer[12];
+	ASSERT(Read(pipe.read, buffer, 12)==12);
+	ASSERT(Poll(pfd, 1, 0)==0);
+
+	/* A full pipe is not ready for writing */
+	ASSERT(StreamControl(pipe.write, CTL_SET_PIPE_SIZE, PIPE_PAGE_SIZE)==PIPE_PAGE_SIZE);
+	char page[PIPE_PAGE_SIZE];
+	memset(page, 0, PIPE_PAGE_SIZE);
+	ASSERT(Write(pipe.write, page, PIPE_PAGE_SIZE)==PIPE_PAGE_SIZE);
+	ASSERT(Poll(pfd+1, 1, 0)==0);
+	ASSERT(Read(pipe.read, page, 1)==1);
+	ASSERT(Poll(pfd+1, 1, 0)==1);
+	ASSERT(Read(pipe.read, page, PIPE_PAGE_SIZE)==PIPE_PAGE_SIZE-1);
+
+	/* Closing the writer wakes up the reader */
+	int closer(int argl, void* args) {
+		fibo(10);
+		Close(pipe.write);
+		return 0;
+	}
+	t = CreateThread(closer, 0, NULL);
+	ASSERT(Poll(pfd, 1, 10000)==1);
+	ASSERT(pfd[0].revents==(POLL_READ|POLL_HANGUP));
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Closed fids and streams without Poll */
+	Fid_t fnull = OpenNull();
+	pfd[1].fd = fnull;
+	pfd[1].events = POLL_READ|POLL_WRITE;
+	ASSERT(Poll(pfd+1, 1, 0)==1);
+	ASSERT(pfd[1].revents==(POLL_READ|POLL_WRITE));
+	Close(fnull);
+	ASSERT(Poll(pfd+1, 1, 0)==1);
+	ASSERT(pfd[1].revents==POLL_INVALID);
+
+	ASSERT(Poll(NULL, 1, 0)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_nonblocking,
+	"Test that non-blocking pipe ends return WOULDBLOCK instead of waiting."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	ASSERT(StreamControl(pipe.read, CTL_GET_NONBLOCK, 0)==0);
+	ASSERT(StreamControl(pipe.read, CTL_SET_NONBLOCK, 1)==0);
+	ASSERT(StreamControl(pipe.write, CTL_SET_NONBLOCK, 1)==0);
+	ASSERT(StreamControl(pipe.read, CTL_GET_NONBLOCK, 0)==1);
+
+	/* The mode is shared by copies of the fid */
+	ASSERT(Dup2(pipe.read, 5)==0);
+	ASSERT(StreamControl(5, CTL_GET_NONBLOCK, 0)==1);
+	Close(5);
+
+	char buffer[PIPE_PAGE_SIZE];
+	ASSERT(Read(pipe.read, buffer, 12)==WOULDBLOCK);
+
+	/* A write copies what fits */
+	ASSERT(StreamControl(pipe.write, CTL_SET_PIPE_SIZE, PIPE_PAGE_SIZE)==PIPE_PAGE_SIZE);
+	memset(buffer, 0, PIPE_PAGE_SIZE);
+	ASSERT(Write(pipe.write, buffer, 12)==12);
+	ASSERT(Write(pipe.write, buffer, PIPE_PAGE_SIZE)==PIPE_PAGE_SIZE-12);
+	ASSERT(Write(pipe.write, buffer, 1)==WOULDBLOCK);
+
+	ASSERT(Read(pipe.read, buffer, PIPE_PAGE_SIZE)==PIPE_PAGE_SIZE);
+	ASSERT(Read(pipe.read, buffer, 1)==WOULDBLOCK);
+
+	/* Back to blocking mode */
+	ASSERT(StreamControl(pipe.read, CTL_SET_NONBLOCK, 0)==0);
+	int writer(int argl, void* args) {
+		fibo(10);
+		ASSERT(Write(pipe.write, "Hello world", 12)==12);
+		return 0;
+	}
+	Tid_t t = CreateThread(writer, 0, NULL);
+	ASSERT(Read(pipe.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* End of data is not WOULDBLOCK */
+	ASSERT(StreamControl(pipe.read, CTL_SET_NONBLOCK, 1)==0);
+	Close(pipe.write);
+	ASSERT(Read(pipe.read, buffer, 12)==0);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1201,6 +1698,11 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
+	&test_pipe_size_control,
+	&test_pipe_splice,
+	&test_pipe_vectored_io,
+	&test_pipe_poll,
+	&test_pipe_nonblocking,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
 	NULL
@@ -1343,6 +1845,53 @@ BOOT_TEST(test_listen_fails_on_initialized_socket,
 }
 
 
+BOOT_TEST(test_listen_reuseport,
+	"Test that sockets set with CTL_SET_REUSEPORT can listen on the same port, that "
+	"connections are spread among them, and that they move when a listener is closed."
+	)
+{
+	Fid_t l1 = Socket(100), l2 = Socket(100), l3 = Socket(100);
+	ASSERT(StreamControl(l1, CTL_SET_REUSEPORT, 1)==0);
+	ASSERT(StreamControl(l2, CTL_SET_REUSEPORT, 1)==0);
+	ASSERT(StreamControl(l1, CTL_GET_REUSEPORT, 0)==1);
+	ASSERT(StreamControl(l3, CTL_GET_REUSEPORT, 0)==0);
+
+	ASSERT(Listen(l1)==0);
+	ASSERT(Listen(l3)==-1);
+	ASSERT(Listen(l2)==0);
+	ASSERT(StreamControl(l2, CTL_SET_REUSEPORT, 0)==-1);
+
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(argl, 100, 10000)==0);
+		return 0;
+	}
+	Fid_t c1 = Socket(NOPORT), c2 = Socket(NOPORT);
+	Tid_t t1 = CreateThread(connect_thread, c1, NULL);
+	Tid_t t2 = CreateThread(connect_thread, c2, NULL);
+
+	/* Each listener gets one of the requests */
+	pollfd_t pfd[2] = { { .fd = l1, .events = POLL_READ }, { .fd = l2, .events = POLL_READ } };
+	for(int i=0; i<100 && Poll(pfd, 2, 100)<2; i++);
+	ASSERT(Poll(pfd, 2, 0)==2);
+
+	Fid_t s1 = Accept(l1);
+	ASSERT(s1!=NOFILE);
+
+	/* The request of l2 moves to l1 */
+	ASSERT(Close(l2)==0);
+	Fid_t s2 = Accept(l1);
+	ASSERT(s2!=NOFILE);
+
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+
+	/* A socket without the flag can listen when the port is free */
+	ASSERT(Close(l1)==0);
+	ASSERT(Listen(l3)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_accept_succeds,
 	"Test that accept succeeds on a legal connection"
 	)
@@ -1395,7 +1944,8 @@ BOOT_TEST(test_accept_reusable,
 	Fid_t lsock = Socket(100);
 	ASSERT(lsock!=NOFILE);
 	ASSERT(Listen(lsock)==0);
-	uint n = MAX_FILEID/2 - 1;
+	/* Each connection takes two threads, so do not scale with MAX_FILEID */
+	uint n = 64;
 	Fid_t cli[n], srv[n];
 
 	for(uint i=0;i<n;i++) {
@@ -1422,30 +1972,32 @@ BOOT_TEST(test_accept_fails_on_exhausted_fid,
 	ASSERT(lsock!=NOFILE);
 	ASSERT(Listen(lsock)==0);
 
-	/* If MAX_FILEID is odd, allocate an extra fid */
-	if( (MAX_FILEID & 1) == 1 )  OpenNull();
-
-	/* Allocate pairs of fids */
-	for(uint i=0;i< (MAX_FILEID-1)/2 ; i++) {		
-		Fid_t cli = Socket(NOPORT);
-		Fid_t srv;
-		ASSERT(cli != NOFILE);
-		connect_sockets(cli,lsock,&srv,100);
-	}
+	/* Take all the fids, but one for the client */
+	Fid_t last = NOFILE;
+	for(Fid_t f; (f = OpenNull()) != NOFILE; ) last = f;
+	ASSERT(last == MAX_FILEID-1);
+	ASSERT(Close(last)==0);
 
 	/* Ok, we should be able to get another client */
 	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
 
-	/* Now, if we try a connection we should fail! */
+	/* Now, if we try a connection, Accept should fail! */
 	int accept_connection(int argl, void* args) {
 		ASSERT(Accept(lsock)==NOFILE);
 		return 0;
 	}
 
 	Tid_t t = CreateThread(accept_connection, 0, NULL);
-	ASSERT(Connect(cli, 100, 1000)==-1);
+	ASSERT(Connect(cli, 100, 1000)==0);
 
 	ThreadJoin(t,NULL);
+
+	/* The connection is still pending */
+	ASSERT(Close(cli)==0);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	char c;
+	ASSERT(Read(srv, &c, 1)==0);
 	return 0;
 }
 
@@ -1472,6 +2024,102 @@ BOOT_TEST(test_accept_unblocks_on_close,
 }
 
 
+BOOT_TEST(test_accept_nonblocking,
+	"Test that Accept on a non-blocking listener returns WOULDBLOCK when there is no request."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(StreamControl(lsock, CTL_SET_NONBLOCK, 1)==0);
+
+	ASSERT(Accept(lsock)==WOULDBLOCK);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(cli!=NOFILE);
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(cli, 100, 1000)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(connect_thread, 0, NULL);
+
+	/* Wait for the request, then accept it without blocking */
+	pollfd_t pfd = { .fd = lsock, .events = POLL_READ };
+	ASSERT(Poll(&pfd, 1, 10000)==1);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE && srv!=WOULDBLOCK);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The new connection is blocking */
+	ASSERT(StreamControl(srv, CTL_GET_NONBLOCK, 0)==0);
+	ASSERT(StreamControl(cli, CTL_SET_NONBLOCK, 1)==0);
+	char buffer[12];
+	ASSERT(Read(cli, buffer, 12)==WOULDBLOCK);
+	check_transfer(srv, cli);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_many_and_backlog,
+	"Test that Connect fails at once when the listener backlog is full, and that "
+	"AcceptMany accepts the pending connections together."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(StreamControl(lsock, CTL_GET_BACKLOG, 0)==DEFAULT_BACKLOG);
+	ASSERT(StreamControl(lsock, CTL_SET_BACKLOG, 1)==0);
+	ASSERT(StreamControl(lsock, CTL_GET_BACKLOG, 0)==1);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t fids[4];
+	ASSERT(AcceptMany(lsock, fids, 0)==NOFILE);
+	ASSERT(AcceptMany(Socket(100), fids, 4)==NOFILE);
+
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(argl, 100, 10000)==0);
+		return 0;
+	}
+
+	/* With one request pending, the backlog is full */
+	Fid_t cli[4];
+	cli[0] = Socket(NOPORT);
+	Tid_t t = CreateThread(connect_thread, cli[0], NULL);
+	pollfd_t pfd = { .fd = lsock, .events = POLL_READ };
+	ASSERT(Poll(&pfd, 1, 10000)==1);
+	ASSERT(Connect(Socket(NOPORT), 100, -1)==-1);
+	ASSERT(AcceptMany(lsock, fids, 4)==1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	check_transfer(fids[0], cli[0]);
+
+	/* Without a limit, all the requests are accepted */
+	ASSERT(StreamControl(lsock, CTL_SET_BACKLOG, 0)==0);
+	Tid_t tids[3];
+	for(int i=1; i<4; i++) {
+		cli[i] = Socket(NOPORT);
+		tids[i-1] = CreateThread(connect_thread, cli[i], NULL);
+	}
+	int accepted = 0;
+	while(accepted < 3) {
+		int rc = AcceptMany(lsock, fids+accepted, 3-accepted);
+		ASSERT(rc>=1 && rc<=3-accepted);
+		accepted += rc;
+	}
+	for(int i=0; i<3; i++) {
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+		ASSERT(StreamControl(fids[i], CTL_GET_PIPE_SIZE, 0)>0);
+	}
+
+	/* More requests than are dequeued at once are all accepted by one call */
+	Fid_t many[100];
+	for(int i=0; i<100; i++)
+		ASSERT(Connect(Socket(NOPORT), 100, -1)==0);
+	ASSERT(AcceptMany(lsock, many, 100)==100);
+
+	return 0;
+}
+
+
 BOOT_TEST(test_connect_fails_on_bad_fid,
 	"Test that Connect will fail if given a bad fid."
 	)
@@ -1525,8 +2173,9 @@ BOOT_TEST(test_connect_fails_on_non_listened_port,
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_timeout,
-	"Test that connect fails on timeout.",
+BOOT_TEST(test_connect_before_accept,
+	"Test that Connect succeeds without waiting for Accept, that data can be sent at once, "
+	"and that a connection which is never accepted ends when the listener is closed.",
 	.timeout = 2
 	)
 {
@@ -1534,9 +2183,31 @@ BOOT_TEST(test_connect_fails_on_timeout,
 	ASSERT(lsock!=NOFILE);
 	ASSERT(Listen(lsock)==0);
 
+	/* Even with a short timeout */
 	Fid_t cli = Socket(10);
-	/* Give it a short timeout */
-	ASSERT(Connect(cli, 100, 100)==-1);
+	ASSERT(Connect(cli, 100, 100)==0);
+	ASSERT(Write(cli, "Hello world", 12)==12);
+
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	check_transfer(srv, cli);
+	char buffer[12];
+	ASSERT(Read(srv, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* A listener that never accepts holds at most its default backlog */
+	Fid_t lsock2 = Socket(101);
+	ASSERT(Listen(lsock2)==0);
+	for(int i=0; i<DEFAULT_BACKLOG; i++)
+		ASSERT(Connect(Socket(NOPORT), 101, 100)==0);
+	ASSERT(Connect(Socket(NOPORT), 101, 100)==-1);
+
+	/* This one is never accepted */
+	cli = Socket(10);
+	ASSERT(Connect(cli, 100, 100)==0);
+	ASSERT(Close(lsock)==0);
+	ASSERT(Read(cli, buffer, 12)==0);
+	ASSERT(Write(cli, "Hello world", 12)==-1);
 
 	return 0;
 }
@@ -1567,6 +2238,108 @@ BOOT_TEST(test_socket_small_transfer,
 }
 
 
+BOOT_TEST(test_socket_splice_echo,
+	"Test that Splice can move data between the two directions of a connection, "
+	"and that the connection can be shut down and closed in any order."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* The server echoes back what it receives */
+	char buffer[12];
+	ASSERT(Write(cli, "Hello world", 12)==12);
+	ASSERT(Splice(srv, srv, 100)==12);
+	ASSERT(Read(cli, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* A direction shut down for reading fails, as for Read */
+	ASSERT(Write(srv, "Hello world", 12)==12);
+	ASSERT(ShutDown(srv, SHUTDOWN_READ)==0);
+	ASSERT(Read(srv, buffer, 12)==-1);
+	ASSERT(Splice(srv, cli, 12)==-1);
+
+	ASSERT(ShutDown(cli, SHUTDOWN_BOTH)==0);
+	ASSERT(Close(srv)==0);
+	ASSERT(StreamControl(cli, CTL_SET_PIPE_SIZE, 1<<16)==1<<16);
+	ASSERT(Read(cli, buffer, 12)==-1);
+	ASSERT(Close(cli)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_message_mode,
+	"Test that a socket in message mode keeps the boundaries of each Write, and "
+	"that it only connects to listeners of the same mode."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(StreamControl(lsock, CTL_GET_MESSAGE_MODE, 0)==0);
+	ASSERT(StreamControl(lsock, CTL_SET_MESSAGE_MODE, 1)==0);
+	ASSERT(StreamControl(lsock, CTL_GET_MESSAGE_MODE, 0)==1);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(StreamControl(lsock, CTL_SET_MESSAGE_MODE, 0)==-1);
+
+	/* A byte socket cannot connect */
+	ASSERT(Connect(Socket(NOPORT), 100, 1000)==-1);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(StreamControl(cli, CTL_SET_MESSAGE_MODE, 1)==0);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(StreamControl(srv, CTL_GET_MESSAGE_MODE, 0)==1);
+
+	/* Each Write is one message, and each Read takes one */
+	char buffer[32];
+	ASSERT(Write(cli, "Hello", 6)==6);
+	ASSERT(Write(cli, "world", 6)==6);
+	ASSERT(Write(cli, "", 0)==0);
+	iovec_t iov[2] = { { .base = "Hello ", .len = 6 }, { .base = "world", .len = 6 } };
+	ASSERT(WriteV(cli, iov, 2)==12);
+
+	ASSERT(Read(srv, buffer, 32)==6);
+	ASSERT(strcmp(buffer, "Hello")==0);
+	ASSERT(Read(srv, buffer, 3)==3);
+	ASSERT(memcmp(buffer, "wor", 3)==0);
+	ASSERT(Read(srv, buffer, 32)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* A message that does not fit in the pipe is not sent */
+	ASSERT(StreamControl(cli, CTL_GET_PIPE_SIZE, 0)==BUFFER_SIZE);
+	static char big[BUFFER_SIZE+1];
+	ASSERT(Write(srv, big, BUFFER_SIZE+1)==-1);
+	ASSERT(Write(srv, big, BUFFER_SIZE)==BUFFER_SIZE);
+
+	/* A non-blocking writer does not wait for room */
+	ASSERT(StreamControl(srv, CTL_SET_NONBLOCK, 1)==0);
+	ASSERT(Write(srv, "Hello", 6)==WOULDBLOCK);
+	ASSERT(Read(cli, big, BUFFER_SIZE+1)==BUFFER_SIZE);
+	ASSERT(Write(srv, "Hello", 6)==6);
+
+	/* After a message did not fit, the socket is writable when it fits */
+	pollfd_t pfd = { .fd = srv, .events = POLL_WRITE };
+	ASSERT(Poll(&pfd, 1, 0)==1);
+	ASSERT(Write(srv, big, BUFFER_SIZE)==WOULDBLOCK);
+	ASSERT(Poll(&pfd, 1, 0)==0);
+	ASSERT(Read(cli, buffer, 32)==6);
+	ASSERT(Poll(&pfd, 1, 0)==1 && pfd.revents==POLL_WRITE);
+	ASSERT(Write(srv, big, BUFFER_SIZE)==BUFFER_SIZE);
+	ASSERT(Read(cli, big, BUFFER_SIZE+1)==BUFFER_SIZE);
+	ASSERT(Write(srv, "Hello", 6)==6);
+
+	/* The queued messages are received before the end of data */
+	ASSERT(Close(srv)==0);
+	ASSERT(Read(cli, buffer, 32)==6);
+	ASSERT(Read(cli, buffer, 32)==0);
+	ASSERT(Splice(cli, cli, 10)==-1);
+
+	return 0;
+}
+
+
 BOOT_TEST(test_socket_single_producer,
 	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
 	)
@@ -1731,6 +2504,51 @@ BOOT_TEST(test_shudown_write,
 
 
 
+BOOT_TEST(test_socket_poll,
+	"Test that Poll reports pending connections on a listening socket, and data on peers."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(cli!=NOFILE);
+
+	pollfd_t pfd[2] = {
+		{ .fd = lsock, .events = POLL_READ },
+		{ .fd = cli, .events = POLL_WRITE }
+	};
+	ASSERT(Poll(pfd, 2, 0)==0);
+
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(cli, 100, 1000)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(connect_thread, 0, NULL);
+
+	/* The listener becomes ready when the request arrives */
+	ASSERT(Poll(pfd, 1, 10000)==1);
+	ASSERT(pfd[0].revents==POLL_READ);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The client is a peer now */
+	ASSERT(Poll(pfd, 2, 0)==1);
+	ASSERT(pfd[1].revents==POLL_WRITE);
+
+	pfd[0].fd = srv;
+	ASSERT(Poll(pfd, 1, 0)==0);
+	ASSERT(Write(cli, "Hello world", 12)==12);
+	ASSERT(Poll(pfd, 1, 0)==1);
+	ASSERT(pfd[0].revents==POLL_READ);
+	check_transfer(srv, cli);
+
+	return 0;
+}
+
+
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
 	)
@@ -1744,6 +2562,7 @@ TEST_SUITE(socket_tests,
 	&test_listen_fails_on_NOPORT,
 	&test_listen_fails_on_occupied_port,
 	&test_listen_fails_on_initialized_socket,
+	&test_listen_reuseport,
 
 	&test_accept_succeds,
 	&test_accept_fails_on_bad_fid,
@@ -1752,20 +2571,26 @@ TEST_SUITE(socket_tests,
 	&test_accept_reusable,
 	&test_accept_fails_on_exhausted_fid,
 	&test_accept_unblocks_on_close,
+	&test_accept_nonblocking,
+	&test_accept_many_and_backlog,
 
 	&test_connect_fails_on_bad_fid,
 	&test_connect_fails_on_bad_socket,
 	&test_connect_fails_on_illegal_port,
 	&test_connect_fails_on_non_listened_port,
-	&test_connect_fails_on_timeout,
+	&test_connect_before_accept,
 
 	&test_socket_small_transfer,
+	&test_socket_splice_echo,
+	&test_socket_message_mode,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
 
 	&test_shudown_read,
 	&test_shudown_write,
 
+	&test_socket_poll,
+
 	NULL
 };
 
@@ -2091,6 +2916,303 @@ TEST_SUITE(io_tests,
 
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *  These are not run as part of all_tests. They report
+ *  their measurements, and fail only on errors.
+ *
+ *
+ *********************************************/
+
+
+BARE_TEST(bench_pipe_contention,
+	"Measure the time for several independent pipes, each with a producer and a consumer\n"
+	"process, to transfer their data on one core and on many cores. Since Read and Write\n"
+	"do not take the kernel lock, unrelated pipes can proceed in parallel.",
+	.timeout = 300
+	)
+{
+#define NPAIRS 4
+	int N = 10000000;
+	struct timeval tstart;
+	double Trun;
+
+	void start_pair()
+	{
+		pipe_t pipe;
+		ASSERT(Pipe(&pipe)==0);
+
+		/* Move the pipe to fids 0 and 1, as in test_pipe_single_producer */
+		if(pipe.read != 0) {
+			if(pipe.write==0) {
+				Fid_t fid = OpenNull();
+				assert(fid!=NOFILE);
+				Dup2(0, fid);
+				pipe.write = fid;
+			}
+			Dup2(pipe.read, 0);
+			Close(pipe.read);
+		}
+		if(pipe.write!=1)  {
+			Dup2(pipe.write, 1);
+			Close(pipe.write);
+		}
+
+		ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+		Close(0);
+		Close(1);
+	}
+
+	int run_pairs(int argl, void* args)
+	{
+		mark_time(&tstart);
+		for(int i=0;i<NPAIRS;i++)
+			start_pair();
+		while(WaitChild(NOPROC, NULL)!=NOPROC);
+		Trun = time_since(&tstart);
+		return 0;
+	}
+
+	uint ncores = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncores > NPAIRS) ncores = NPAIRS;
+
+	boot(1, 0, run_pairs, 0, NULL);
+	double T1 = Trun;
+	MSG("%d pipes of %d bytes, 1 core: %f sec\n", NPAIRS, N, T1);
+
+	if(ncores < 2) {
+		MSG("Cannot measure scaling on this machine, there is only 1 core.\n");
+		return;
+	}
+
+	boot(ncores, 0, run_pairs, 0, NULL);
+	double Tn = Trun;
+	MSG("%d pipes of %d bytes, %u cores: %f sec   (speedup %.2f)\n", NPAIRS, N, ncores, Tn, T1/Tn);
+#undef NPAIRS
+}
+
+
+
+BARE_TEST(bench_stream_churn,
+	"Measure the time for several threads of one process to create, use and close\n"
+	"many short-lived pipes, on one core and on many cores. Creating and closing\n"
+	"a stream takes the kernel lock; Read and Write only take and drop atomic\n"
+	"references to the FCBs.",
+	.timeout = 300
+	)
+{
+#define NTHREADS 4
+	int N = 100000;
+	struct timeval tstart;
+	double Trun;
+
+	int churn(int argl, void* args)
+	{
+		char c = 'x';
+		for(int i=0; i<N; i++) {
+			pipe_t pipe;
+			ASSERT(Pipe(&pipe)==0);
+			ASSERT(Write(pipe.write, &c, 1)==1);
+			ASSERT(Read(pipe.read, &c, 1)==1);
+			ASSERT(Close(pipe.write)==0);
+			ASSERT(Close(pipe.read)==0);
+		}
+		return 0;
+	}
+
+	int run_threads(int argl, void* args)
+	{
+		Tid_t tids[NTHREADS];
+		mark_time(&tstart);
+		for(int i=0;i<NTHREADS;i++)
+			ASSERT((tids[i] = CreateThread(churn, 0, NULL))!=NOTHREAD);
+		for(int i=0;i<NTHREADS;i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		Trun = time_since(&tstart);
+		return 0;
+	}
+
+	uint ncores = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncores > NTHREADS) ncores = NTHREADS;
+
+	boot(1, 0, run_threads, 0, NULL);
+	double T1 = Trun;
+	MSG("%d threads x %d pipes, 1 core: %f sec  (%.2f usec per pipe)\n", 
+		NTHREADS, N, T1, 1e6*T1/(NTHREADS*N));
+
+	if(ncores < 2) {
+		MSG("Cannot measure scaling on this machine, there is only 1 core.\n");
+		return;
+	}
+
+	boot(ncores, 0, run_threads, 0, NULL);
+	double Tn = Trun;
+	MSG("%d threads x %d pipes, %u cores: %f sec  (speedup %.2f)\n", 
+		NTHREADS, N, ncores, Tn, T1/Tn);
+#undef NTHREADS
+}
+
+
+
+BARE_TEST(bench_thread_churn,
+	"Measure the time to create, run and join many short-lived threads, in small\n"
+	"batches. In steady state, the thread memory comes from the per-core cache.",
+	.timeout = 300
+	)
+{
+	int N = 100000;
+	int BATCH = 8;
+	struct timeval tstart;
+	double Trun;
+
+	int nop(int argl, void* args) { return argl; }
+
+	int churn(int argl, void* args)
+	{
+		Tid_t tids[BATCH];
+		mark_time(&tstart);
+		for(int i=0; i<N; i+=BATCH) {
+			for(int j=0; j<BATCH; j++) {
+				tids[j] = CreateThread(nop, j, NULL);
+				ASSERT(tids[j]!=NOTHREAD);
+			}
+			for(int j=0; j<BATCH; j++)
+				ASSERT(ThreadJoin(tids[j], NULL)==0);
+		}
+		Trun = time_since(&tstart);
+		return 0;
+	}
+
+	boot(1, 0, churn, 0, NULL);
+	MSG("%d threads, in batches of %d: %f sec  (%.2f usec per thread)\n", 
+		N, BATCH, Trun, 1e6*Trun/N);
+}
+
+
+
+BARE_TEST(bench_context_switch,
+	"Measure context switches per second, with two threads on one core which\n"
+	"take turns through a mutex and two condition variables. Every turn is a\n"
+	"switch to the other thread.",
+	.timeout = 300
+	)
+{
+	int N = 1000000;
+	struct timeval tstart;
+	double Trun;
+
+	Mutex mx = MUTEX_INIT;
+	CondVar turn_cv[2] = { COND_INIT, COND_INIT };
+	int turn = 0;
+
+	int player(int me, void* args)
+	{
+		Mutex_Lock(&mx);
+		for(int i=0; i<N/2; i++) {
+			while(turn != me) Cond_Wait(&mx, &turn_cv[me]);
+			turn = 1-me;
+			Cond_Signal(&turn_cv[1-me]);
+		}
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	int ping_pong(int argl, void* args)
+	{
+		mark_time(&tstart);
+		Tid_t t = CreateThread(player, 1, NULL);
+		ASSERT(t!=NOTHREAD);
+		player(0, NULL);
+		ASSERT(ThreadJoin(t, NULL)==0);
+		Trun = time_since(&tstart);
+		return 0;
+	}
+
+	boot(1, 0, ping_pong, 0, NULL);
+	MSG("%d turns: %f sec  (%.0f switches per second)\n", N, Trun, N/Trun);
+}
+
+
+
+BARE_TEST(bench_connect_storm,
+	"Measure connections per second, with several client threads that connect to one\n"
+	"port and close, as fast as a server thread accepts the connections\n"
+	"with AcceptMany and closes them.",
+	.timeout = 300
+	)
+{
+#define NCLIENTS 4
+	int N = 100000;
+	struct timeval tstart;
+	double Trun;
+
+	int client(int argl, void* args)
+	{
+		for(int i=0; i<N/NCLIENTS; i++) {
+			Fid_t sock = Socket(NOPORT);
+			ASSERT(sock!=NOFILE);
+			ASSERT(Connect(sock, 100, -1)==0);
+			ASSERT(Close(sock)==0);
+		}
+		return 0;
+	}
+
+	int storm(int argl, void* args)
+	{
+		Fid_t lsock = Socket(100);
+		/* The clients do not retry a Connect, so do not limit the pending connections */
+		ASSERT(StreamControl(lsock, CTL_SET_BACKLOG, 0)==0);
+		ASSERT(Listen(lsock)==0);
+
+		mark_time(&tstart);
+		Tid_t tids[NCLIENTS];
+		for(int i=0; i<NCLIENTS; i++)
+			ASSERT((tids[i] = CreateThread(client, 0, NULL))!=NOTHREAD);
+
+		int accepted = 0;
+		while(accepted < N) {
+			Fid_t fids[16];
+			int n = AcceptMany(lsock, fids, 16);
+			ASSERT(n>0);
+			for(int i=0; i<n; i++)
+				ASSERT(Close(fids[i])==0);
+			accepted += n;
+		}
+
+		for(int i=0; i<NCLIENTS; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		Trun = time_since(&tstart);
+		return 0;
+	}
+
+	boot(1, 0, storm, 0, NULL);
+	MSG("%d connections from %d clients: %f sec  (%.0f connections per second)\n", 
+		N, NCLIENTS, Trun, N/Trun);
+#undef NCLIENTS
+}
+
+
+
+TEST_SUITE(benchmark_tests,
+	"A suite of benchmarks for the kernel. These are not part of all_tests."
+	)
+{
+	&bench_pipe_contention,
+	&bench_stream_churn,
+	&bench_thread_churn,
+	&bench_context_switch,
+	&bench_connect_storm,
+	NULL
+};
+
+
+
 /*********************************************
  *
  *
@@ -2152,6 +3274,7 @@ TEST_SUITE(user_tests,
 int main(int argc, char** argv)
 {
 	register_test(&all_tests);
+	register_test(&benchmark_tests);
 	register_test(&user_tests);
 	return run_program(argc, argv, &all_tests);
 }